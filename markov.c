@@ -1,141 +1,1384 @@
 #include <errno.h>
-#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "m_pd.h"
+#include "markov_core.h"
+#ifdef PM_STATIC_MODEL
+#include "markov_model.h"  // Written by make header
+#endif
 
-#define DELIMITERS ",;\n"
-#define MAX_LINE_SIZE 1024
+#define LOG_ZERO PM_LOG_ZERO
+#define CLASSIFY_FLOOR -16.0f  // Log probability of an unlisted transition
+#define TRACE_SIZE 65536       // Transitions kept by trace
+#define TRACE_MAGIC "PMTR"
+#define TRACE_VERSION 1
+#define HISTORY_SIZE 1024   // Steps rewind can undo
+#define BEST_BEAM 1024      // Partial phrases best keeps per step, at least
+#define PREFETCH_SIZE 1024  // Steps the prefetch worker runs ahead
+#define WATCH_PERIOD 250    // Milliseconds between takes of a reloaded model
+#define ANALYZE_PERIOD 50   // Milliseconds between looks at a running analyze
 
 static t_class *markov_class;
 
+typedef struct _cache t_cache;
+
+// A core model with its states interned as Pd symbols
+typedef struct _model {
+  pm_model *pm;
+  t_symbol **state_symbols;  // (state, interned name)
+  pm_map symbol_map;         // t_symbol address -> state
+  int n_refs;                // Objects holding the model
+  t_cache *cache;            // Cache listing the model while unedited, or NULL
+} t_model;
+
+// Unedited models loaded by the objects of one Pd instance. Symbols are
+// interned per instance, so models are never shared across instances.
+struct _cache {
+  t_pdinstance *instance;
+  int n_models;
+  t_model **models;
+  t_cache *next;
+};
+
+static t_cache *caches;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Hidden Markov decoder with its observed symbols interned
+typedef struct _hmm {
+  pm_hmm *pm;
+  t_symbol **symbols;  // (symbol, interned name)
+} t_hmm;
+
+// Model scored by classify
+typedef struct _candidate {
+  t_model *model;
+  pm_scorer scorer;
+  float score;
+} t_candidate;
+
+// One transition recorded by trace
+typedef struct _trace_record {
+  double time;      // clock_getlogicaltime() at the bang
+  int64_t gram_i;   // Row sampled from, or -1
+  int32_t state_i;  // Sampled state, or -1
+  uint32_t draw;    // Raw random draw the state was sampled with
+} t_trace_record;
+
+// Where the cursor stood before one output, which rewind returns to
+typedef struct _history_record {
+  uint64_t key;  // Gram, by key so it outlives reordering and reloads
+  pm_rng rng;
+} t_history_record;
+
+// Sub-model of one section, loaded ahead so switching to it swaps pointers
+typedef struct _part {
+  t_model *model;         // NULL if not loaded, or while lent to the sampler
+  pm_smoother *smoother;  // Its smoothing, kept while another part plays
+} t_part;
+
 typedef struct _markov {
   t_object x_obj;
   t_outlet *out_state;
-  const char *csv_path;
+  t_outlet *out_hidden;
+
+  t_model *model;
+  t_model *target;  // Model crossfaded to by morph, or NULL
+  pm_memory memory;  // Placement of the models it loads, set by hugepages
+  pm_cursor cursor;
+  float morph;
+  float temperature;  // Reshaping of each row, through the models' ranks
+  int top_k;
+  pm_smoother *smoother;  // Lower orders interpolated by smooth, or NULL
+  pm_prefetch *prefetch;  // Steps taken ahead by a worker thread, or NULL
+  pm_watch *watch;        // Reloads the model's CSV when it changes, or NULL
+  t_clock *watch_clock;   // Takes what watch reloaded, on the scheduler
 
-  int curr_gram_i;
+  // Runs of analyze in progress, holding the models and smoothing they
+  // sample so edits meanwhile clone them
+  pm_analyzer *analyzer;  // Or NULL
+  t_model *analyzed_model;
+  t_model *analyzed_target;
+  pm_smoother *analyzed_smoother;
+  t_clock *analyze_clock;  // Outputs the results once finished
 
-  int order;
-  int n_states;
-  int n_grams;  // n_states ** order
+  t_hmm *hmm;  // Emissions decoded by observe, or NULL
 
-  char **states;
-  char **grams;           // (index, state)
-  float **probabilities;  // (index, probability)
+  // Two-level mode: a chain over sections picks the part sampled next
+  t_model *sections;  // Chain whose states are sections, or NULL
+  pm_cursor section_cursor;
+  t_part *parts;  // (section, part), then the object's own model
+  int part_i;     // Part lent to model and smoother
+
+  t_outlet *out_info;
+  int n_candidates;
+  t_candidate *candidates;
+  float decay;  // Weight of past scores at each classify
+
+  int tracing;
+  t_trace_record *trace;  // Ring of TRACE_SIZE records, or NULL
+  uint64_t n_traced;      // Records written, the next goes at % TRACE_SIZE
+
+  t_history_record *history;  // Ring of HISTORY_SIZE records, or NULL
+  uint64_t n_history;         // Steps kept, the next goes at % HISTORY_SIZE
+
+  // Selectors interned in the object's Pd instance
+  t_symbol *s_score;
+  t_symbol *s_classify;
+  t_symbol *s_analyze;
+  t_symbol *s_section;
+  t_symbol *s_best;
 } t_markov;
 
+static void log_post(void *user, const char *message) {
+  (void)user;
+  post("%s", message);
+}
+
+// The model the object was created with, even while a section's part plays
+static t_model *own_model(const t_markov *x) {
+  if (x->sections == NULL) return x->model;
+
+  const int own_i = x->sections->pm->n_states;
+  return x->part_i == own_i ? x->model : x->parts[own_i].model;
+}
+
+static const pm_model *core(const t_model *model) {
+  return model != NULL ? model->pm : NULL;
+}
+
 void print(t_markov *x) {
+  const pm_model *model = core(x->model);
+  if (model == NULL) {
+    post("WARNING: t_markov.model is NULL");
+    return;
+  }
+
   post("[markov ]");
-  post("[markov ] csv_path=%s", x->csv_path);
-  post("[markov ] order=%i, n_states=%i, n_grams=%i", x->order, x->n_states,
-       x->n_grams);
+  post("[markov ] csv_path=%s", model->csv_path);
+  post("[markov ] order=%i, n_states=%i, n_grams=%lld", model->order, model->n_states,
+       (long long)model->n_grams);
 
   post("[markov ] probability matrix:");
-  if (x->states == NULL)
+  if (model->states == NULL)
     post("WARNING: t_markov.states is NULL");
   else
-    for (int i = 0; i < x->n_states; ++i)
+    for (int i = 0; i < model->n_states; ++i)
       post("[markov ] states[%i]: %s", i,
-           x->states[i] != NULL ? x->states[i] : "NULL");
+           model->states[i] != NULL ? model->states[i] : "NULL");
 
-  if (x->grams == NULL)
+  if (model->grams == NULL)
     post("WARNING: t_markov.grams is NULL");
   else
-    for (int i = 0; i < x->n_grams; ++i)
-      post("[markov ] grams[%i]: %s", i,
-           x->grams[i] != NULL ? x->grams[i] : "NULL");
+    for (int64_t i = 0; i < model->n_grams; ++i)
+      post("[markov ] grams[%lld]: %s", (long long)i,
+           model->grams[i] != NULL ? model->grams[i] : "NULL");
 
-  if (x->probabilities == NULL)
+  if (model->probabilities == NULL)
     post("WARNING: t_markov.probabilities is NULL");
-  else if (x->states != NULL && x->grams != NULL)
-    for (int i = 0; i < x->n_grams; ++i)
-      for (int j = 0; j < x->n_states; ++j)
-        post("[markov ] probabilities[%i][%i] (%s -> %s): %f", i, j,
-             x->grams[i], x->states[j],
-             x->probabilities[i] != NULL ? x->probabilities[i][j] : -1);
+  else if (model->states != NULL && model->grams != NULL)
+    for (int64_t i = 0; i < model->n_grams; ++i)
+      for (int j = 0; j < model->n_states; ++j)
+        post("[markov ] probabilities[%lld][%i] (%s -> %s): %f", (long long)i,
+             j, model->grams[i], model->states[j],
+             model->probabilities[model->gram_rows[i]][j]);
 }
 
-int csv_to_pm(t_markov *x, const char *csv_path) {
-  FILE *file = fopen(csv_path, "r");
-  if (file == NULL) {
-    post("Error opening file %s. %s", csv_path, strerror(errno));
-    return 1;
+// Finds the cache of the current Pd instance, creating it if needed. The lock
+// only guards the list of instances: each cache is touched by its own
+// instance alone, and never on the bang path.
+static t_cache *instance_cache(void) {
+  pthread_mutex_lock(&caches_lock);
+  t_cache *cache = caches;
+  while (cache != NULL && cache->instance != pd_this) cache = cache->next;
+  if (cache == NULL && (cache = (t_cache *)calloc(1, sizeof(t_cache))) != NULL) {
+    cache->instance = pd_this;
+    cache->next = caches;
+    caches = cache;
   }
+  pthread_mutex_unlock(&caches_lock);
+  return cache;
+}
+
+static void free_cache_if_empty(t_cache *cache) {
+  if (cache == NULL || cache->n_models > 0) return;
+
+  pthread_mutex_lock(&caches_lock);
+  t_cache **link = &caches;
+  while (*link != cache) link = &(*link)->next;
+  *link = cache->next;
+  pthread_mutex_unlock(&caches_lock);
+
+  free(cache->models);
+  free(cache);
+}
 
-  x->states = (char **)malloc(x->n_states * sizeof(char *));
-  x->grams = (char **)malloc(x->n_grams * sizeof(char *));
-  x->probabilities = (float **)malloc(x->n_grams * sizeof(float *));
-  for (int i = 0; i < x->n_grams; ++i)
-    x->probabilities[i] = (float *)malloc(x->n_states * sizeof(float));
+static void uncache(t_model *model) {
+  t_cache *cache = model->cache;
+  if (cache == NULL) return;
+
+  model->cache = NULL;
+  for (int i = 0; i < cache->n_models; ++i)
+    if (cache->models[i] == model) {
+      cache->models[i] = cache->models[--cache->n_models];
+      break;
+    }
+  free_cache_if_empty(cache);
+}
+
+static void delete_pm(t_model *model) {
+  pm_model_free(model->pm);
+  free(model->state_symbols);
+  pm_map_free(&model->symbol_map);
+  free(model);
+}
+
+// Drops one object's hold on a model, freeing it with the last
+void free_pm(t_model *model) {
+  if (model == NULL || --model->n_refs > 0) return;
+
+  uncache(model);
+  delete_pm(model);
+}
 
-  if (x->states == NULL || x->grams == NULL || x->probabilities == NULL) {
-    post("Error allocating memory for t_markov");
-    return 1;
+// Wraps a core model, interning its states in the current Pd instance
+static t_model *wrap_pm(pm_model *pm) {
+  t_model *model = (t_model *)calloc(1, sizeof(t_model));
+  if (model == NULL) {
+    post("Error allocating memory for t_model");
+    pm_model_free(pm);
+    return NULL;
   }
 
-  char line[MAX_LINE_SIZE];
-  int line_i = 0;
+  model->pm = pm;
+  model->n_refs = 1;
+  model->state_symbols =
+      (t_symbol **)malloc(pm->n_states * sizeof(t_symbol *));
+  if (model->state_symbols == NULL || pm_map_init(&model->symbol_map, 16)) {
+    post("Error allocating memory for t_model");
+    delete_pm(model);
+    return NULL;
+  }
+  for (int i = 0; i < pm->n_states; ++i) {
+    model->state_symbols[i] = gensym(pm->states[i]);
+    if (pm_map_put(&model->symbol_map,
+                   (uint64_t)(uintptr_t)model->state_symbols[i], i)) {
+      post("Error allocating memory for t_model");
+      delete_pm(model);
+      return NULL;
+    }
+  }
 
-  while (fgets(line, sizeof(line), file)) {
-    char *token = strtok(line, DELIMITERS);
-    int col_i = 0;
+  return model;
+}
 
-    while (token != NULL) {
-      if (line_i == 0) {  // State
-        if (col_i > 0) x->states[col_i - 1] = strdup(token);
-      } else {
-        if (col_i == 0)  // Gram
-          x->grams[line_i - 1] = strdup(token);
-        else  // Probability
-          x->probabilities[line_i - 1][col_i - 1] = atof(token);
-      }
+static int same_memory(const pm_memory *a, const pm_memory *b) {
+  return a->pages == b->pages && a->numa == b->numa && a->node == b->node;
+}
 
-      token = strtok(NULL, DELIMITERS);
-      ++col_i;
+// Returns the current instance's unedited copy of a CSV placed by memory, or
+// loads it. A copy whose CSV changed on disk since leaves the cache to the
+// objects holding it, and the CSV is read again.
+t_model *load_pm(const char *csv_path, int order, int n_states,
+                 const pm_memory *memory) {
+  t_cache *cache = instance_cache();
+  if (cache != NULL)
+    for (int i = 0; i < cache->n_models; ++i) {
+      t_model *model = cache->models[i];
+      if (model->pm->order != order || model->pm->n_states != n_states ||
+          !same_memory(&model->pm->memory, memory) ||
+          strcmp(model->pm->csv_path, csv_path) != 0)
+        continue;
+      if (pm_model_csv_changed(model->pm)) {
+        model->cache = NULL;
+        cache->models[i--] = cache->models[--cache->n_models];
+        continue;
+      }
+      ++model->n_refs;
+      return model;
     }
 
-    ++line_i;
+  pm_model *pm =
+      pm_model_load_csv(csv_path, order, n_states, memory, log_post, NULL);
+  t_model *model = pm != NULL ? wrap_pm(pm) : NULL;
+  if (model == NULL || cache == NULL) {
+    free_cache_if_empty(cache);
+    return model;
   }
 
-  fclose(file);
-  return 0;
+  t_model **models = (t_model **)realloc(
+      cache->models, (cache->n_models + 1) * sizeof(t_model *));
+  if (models != NULL) {  // Otherwise the model just goes uncached
+    cache->models = models;
+    cache->models[cache->n_models++] = model;
+    model->cache = cache;
+  }
+  free_cache_if_empty(cache);
+  return model;
 }
 
+// Replaces *slot with a private clone placed by memory. Returns NULL if it
+// cannot be allocated.
+static pm_model *clone_pm(t_model **slot, const pm_memory *memory) {
+  pm_model *pm = pm_model_place((*slot)->pm, memory);
+  t_model *clone = pm != NULL ? wrap_pm(pm) : NULL;
+  if (clone == NULL) {
+    post("Error allocating memory for t_model");
+    return NULL;
+  }
+
+  free_pm(*slot);
+  *slot = clone;
+  return clone->pm;
+}
+
+// Makes *slot safe to edit. A model other objects hold, or compiled in, is
+// replaced by a private clone, and one held alone leaves the cache so later
+// loads reread its CSV. Returns NULL if the clone cannot be allocated.
+static pm_model *edit_pm(t_model **slot) {
+  t_model *model = *slot;
+  if (model->n_refs == 1 && !model->pm->is_static) {
+    uncache(model);
+    return model->pm;
+  }
+  return clone_pm(slot, &model->pm->memory);
+}
+
+// Runs on the scheduler thread at every bang, so it must not allocate, lock,
+// intern symbols or make system calls: everything it touches is allocated by
+// the messages that set it up, and the cursor carries its own RNG.
 int transition(t_markov *x) {
-  const int curr_gram_i = x->curr_gram_i;
-
-  // Transition to next state
-  float r = (float)arc4random() / UINT32_MAX;
-  float cdf = 0;
-  int next_state_i = -1;
-  for (int i = 0; i < x->n_states; ++i) {
-    cdf += x->probabilities[curr_gram_i][i];
-    if (r <= cdf) {
-      next_state_i = i;
-      break;
+  const int64_t gram_i = x->cursor.gram_i;
+  const uint64_t key = x->cursor.key;
+  const pm_rng rng = x->cursor.rng;
+  int next_state_i;
+  if (x->prefetch != NULL) {
+    next_state_i = pm_prefetch_step(x->prefetch, &x->cursor);
+  } else {
+    next_state_i =
+        x->smoother != NULL
+            ? pm_smooth_step(x->model->pm, core(x->target), x->smoother,
+                             &x->cursor)
+            : pm_step(x->model->pm, core(x->target), &x->cursor);
+  }
+
+  if (x->tracing) {
+    t_trace_record *record = &x->trace[x->n_traced++ % TRACE_SIZE];
+    record->time = clock_getlogicaltime();
+    record->gram_i = gram_i;
+    record->state_i = next_state_i;
+    record->draw = x->cursor.draw;
+  }
+  if (x->history != NULL && next_state_i != -1) {
+    t_history_record *record = &x->history[x->n_history++ % HISTORY_SIZE];
+    record->key = key;
+    record->rng = rng;
+  }
+
+  return next_state_i;
+}
+
+// Stops the prefetch worker before a message edits what it samples. Steps
+// taken ahead are dropped, and the cursor stays after the last one output.
+static void pause_prefetch(t_markov *x) {
+  if (x->prefetch != NULL) pm_prefetch_stop(x->prefetch);
+}
+
+static void resume_prefetch(t_markov *x) {
+  if (x->prefetch == NULL ||
+      !pm_prefetch_start(x->prefetch, x->model->pm, core(x->target),
+                         x->smoother, &x->cursor))
+    return;
+
+  post("Error starting the prefetch thread");
+  pm_prefetch_free(x->prefetch);
+  x->prefetch = NULL;
+}
+
+// Restarts the prefetch worker from the cursor after a message changed the
+// cursor alone, so the worker keeps running through sweeps of its parameters
+static void retune_prefetch(t_markov *x) {
+  if (x->prefetch != NULL) pm_prefetch_retune(x->prefetch, &x->cursor);
+}
+
+// Without smoothing, a cursor on an unlisted gram would never sample again
+static void settle_cursor(t_markov *x) {
+  if (x->smoother == NULL)
+    pm_cursor_settle(&x->cursor, x->model->pm, core(x->target));
+}
+
+static inline int find_state(const t_model *model, const t_symbol *state) {
+  return pm_map_get(&model->symbol_map, (uint64_t)(uintptr_t)state);
+}
+
+static void set_probability(t_markov *x, const t_symbol *gram,
+                            const t_symbol *state, t_float probability) {
+  const pm_model *model = x->model->pm;
+
+  uint64_t key;
+  int64_t gram_i = pm_model_parse_gram(model, gram->s_name, &key)
+                       ? -1
+                       : pm_map_get(&model->gram_map, key);
+  int state_i = find_state(x->model, state);
+  if (gram_i == -1 || state_i == -1 || !(probability >= 0)) {
+    post("[markov ] set: no gram %s, state %s or probability %f", gram->s_name,
+         state->s_name, probability);
+    return;
+  }
+
+  pause_prefetch(x);
+  pm_model *edited = edit_pm(&x->model);
+  if (edited != NULL && pm_model_set(edited, gram_i, state_i, probability))
+    post("Error allocating memory for t_model");
+  if (x->smoother != NULL) pm_smoother_update(x->smoother, x->model->pm);
+  resume_prefetch(x);
+}
+
+// Moves the cursor to a gram named as in the CSV, through the model's perfect
+// hash, or given as one state per symbol. Unlisted grams are only reachable
+// when smoothing can sample from them.
+static void set_gram(t_markov *x, int argc, const t_atom *argv) {
+  const pm_model *model = x->model->pm;
+  uint64_t key = 0;
+  int found = 1;
+  if (argc == 1) {
+    int64_t gram_i = pm_model_find_name(model, argv[0].a_w.w_symbol->s_name);
+    found = gram_i != -1;
+    if (found) key = model->gram_keys[gram_i];
+  } else if (argc == model->order) {
+    for (int i = 0; i < argc && found; ++i) {
+      int state_i = find_state(x->model, argv[i].a_w.w_symbol);
+      found = state_i != -1;
+      key = key << model->state_bits | (uint64_t)(found ? state_i : 0);
     }
+    found = found &&
+            (x->smoother != NULL || pm_model_find_gram(model, key) != -1);
+  } else {
+    found = 0;
+  }
+  if (!found) {
+    post("[markov ] set: no gram %s%s", argv[0].a_w.w_symbol->s_name,
+         argc > 1 ? " ..." : "");
+    return;
+  }
+
+  pm_cursor_set_key(&x->cursor, model, core(x->target), key);
+  retune_prefetch(x);
+}
+
+// set <gram> <state> <probability> edits a transition, set <gram> or
+// set <state> ... moves the cursor
+void on_set(t_markov *x, const t_symbol *s, int argc, const t_atom *argv) {
+  (void)s;
+  if (x->model == NULL) return;
+
+  int n_symbols = 0;
+  while (n_symbols < argc && argv[n_symbols].a_type == A_SYMBOL) ++n_symbols;
+  if (argc == 3 && n_symbols == 2 && argv[2].a_type == A_FLOAT)
+    set_probability(x, argv[0].a_w.w_symbol, argv[1].a_w.w_symbol,
+                    argv[2].a_w.w_float);
+  else if (argc > 0 && n_symbols == argc)
+    set_gram(x, argc, argv);
+  else
+    post("[markov ] set: expects <gram> <state> <probability> or <gram>");
+}
+
+// Moves the cursor back to the first gram, where it starts
+void on_reset(t_markov *x) {
+  if (x->model == NULL) return;
+
+  pm_cursor_set_key(&x->cursor, x->model->pm, core(x->target),
+                    x->model->pm->gram_keys[0]);
+  retune_prefetch(x);
+}
+
+// Returns the cursor to where it stood n outputs ago, RNG included, so the
+// next bangs repeat them until branch
+void on_rewind(t_markov *x, const t_floatarg n) {
+  if (x->model == NULL || x->history == NULL) return;
+
+  const uint64_t n_kept = x->n_history < HISTORY_SIZE ? x->n_history
+                                                      : HISTORY_SIZE;
+  uint64_t n_steps = n < 1 ? 1 : n;
+  if (n_steps > n_kept) {
+    post("[markov ] rewind: only %llu steps kept", (unsigned long long)n_kept);
+    if (n_kept == 0) return;
+    n_steps = n_kept;
+  }
+
+  x->n_history -= n_steps;
+  const t_history_record *record = &x->history[x->n_history % HISTORY_SIZE];
+  pm_cursor_set_key(&x->cursor, x->model->pm, core(x->target), record->key);
+  x->cursor.rng = record->rng;
+  settle_cursor(x);
+  retune_prefetch(x);
+}
+
+static uint64_t random_seed(void) {
+  return (uint64_t)arc4random() << 32 | arc4random();
+}
+
+// Reseeds the cursor, so the chain continues differently from here
+void on_branch(t_markov *x) {
+  if (x->model == NULL) return;
+
+  x->cursor.rng.state = random_seed();
+  retune_prefetch(x);
+}
+
+static void set_muted(t_markov *x, const t_symbol *state, char muted) {
+  if (x->model == NULL) return;
+
+  int state_i = find_state(x->model, state);
+  if (state_i == -1) {
+    post("[markov ] no state %s", state->s_name);
+    return;
   }
 
-  // Update gram
-  char new_gram[x->order];
-  for (int i = 1; i < x->order; ++i) new_gram[i - 1] = x->grams[curr_gram_i][i];
-  new_gram[x->order - 1] = *x->states[next_state_i];
+  pause_prefetch(x);
+  if (x->model->pm->muted[state_i] != muted && edit_pm(&x->model) != NULL)
+    pm_model_mute(x->model->pm, state_i, muted);
+  if (x->target != NULL && x->target->pm->muted[state_i] != muted &&
+      edit_pm(&x->target) != NULL)
+    pm_model_mute(x->target->pm, state_i, muted);
+  if (x->smoother != NULL) pm_smoother_update(x->smoother, x->model->pm);
+  resume_prefetch(x);
+}
+
+void on_mute(t_markov *x, const t_symbol *state) { set_muted(x, state, 1); }
+
+void on_unmute(t_markov *x, const t_symbol *state) { set_muted(x, state, 0); }
+
+static void load_target(t_markov *x, const t_symbol *t_sym) {
+  const pm_model *model = x->model->pm;
+
+  free_pm(x->target);
+  x->target = NULL;
+  pm_cursor_set_target(&x->cursor, NULL);
+  if (*t_sym->s_name == '\0') return;
+
+  t_model *target =
+      load_pm(t_sym->s_name, model->order, model->n_states, &x->memory);
+  if (target == NULL) return;
+
+  for (int i = 0; i < model->n_states; ++i)
+    if (strcmp(target->pm->states[i], model->states[i]) != 0) {
+      post("Error: %s does not list the states of %s in the same order",
+           target->pm->csv_path, model->csv_path);
+      free_pm(target);
+      return;
+    }
+
+  for (int i = 0; i < model->n_states; ++i)
+    if (target->pm->muted[i] != model->muted[i] && edit_pm(&target) != NULL)
+      pm_model_mute(target->pm, i, model->muted[i]);
+
+  if (x->cursor.shaped && pm_model_rank(target->pm))
+    post("Error allocating memory for ranks");
+
+  x->target = target;
+  pm_cursor_set_target(&x->cursor, target->pm);
+}
+
+// Loads a second model over the same states to crossfade to, or unloads it
+// when given no path
+void on_target(t_markov *x, const t_symbol *t_sym) {
+  if (x->model == NULL) return;
+
+  pause_prefetch(x);
+  load_target(x, t_sym);
+  settle_cursor(x);
+  resume_prefetch(x);
+}
+
+void on_morph(t_markov *x, const t_floatarg morph) {
+  x->morph = morph < 0 ? 0 : morph > 1 ? 1 : morph;
+  pm_cursor_set_morph(&x->cursor, x->morph);
+  retune_prefetch(x);
+}
+
+// Samples from the model interpolated with its lower orders, counting each
+// distinct successor of a row as count pseudo-observations, or from the model
+// alone when count is 0
+void on_smooth(t_markov *x, const t_floatarg count) {
+  if (x->model == NULL) return;
+
+  pause_prefetch(x);
+  if (!(count > 0)) {
+    pm_smoother_free(x->smoother);
+    x->smoother = NULL;
+    settle_cursor(x);
+  } else if (x->smoother == NULL) {
+    x->smoother = pm_smoother_new(x->model->pm, count);
+    if (x->smoother == NULL) post("Error allocating memory for smoothing");
+  } else {
+    x->smoother->smooth = count;
+    pm_smoother_update(x->smoother, x->model->pm);
+  }
+  resume_prefetch(x);
+}
+
+// Ranks the rows of every model sampled, once, so reshaping never rewrites
+// them. A model left unranked is sampled unshaped.
+static void rank_models(t_markov *x) {
+  int failed = pm_model_rank(x->model->pm) ||
+               (x->target != NULL && pm_model_rank(x->target->pm));
+  for (int m = 0; x->smoother != NULL && m < x->smoother->order; ++m)
+    failed = pm_model_rank(x->smoother->marginals[m]) || failed;
+  if (failed) post("Error allocating memory for ranks");
+}
+
+static int is_ranked(const t_markov *x) {
+  if (x->model->pm->ranks == NULL ||
+      (x->target != NULL && x->target->pm->ranks == NULL))
+    return 0;
+  for (int m = 0; x->smoother != NULL && m < x->smoother->order; ++m)
+    if (x->smoother->marginals[m]->ranks == NULL) return 0;
+  return 1;
+}
+
+// Only stops the prefetch worker the first time ranks are built, so
+// temperature and topk can be swept while it runs
+static void shape(t_markov *x) {
+  if (x->model == NULL) return;
+
+  pm_cursor_set_shape(&x->cursor, x->temperature, x->top_k);
+  if (x->cursor.shaped && !is_ranked(x)) {
+    pause_prefetch(x);
+    rank_models(x);
+    resume_prefetch(x);
+  } else {
+    retune_prefetch(x);
+  }
+}
+
+// Sharpens each row below 1, flattens it above, and always takes the most
+// likely state at 0
+void on_temperature(t_markov *x, const t_floatarg temperature) {
+  x->temperature = temperature < 0 ? 0 : temperature;
+  shape(x);
+}
+
+// Samples only the k most likely states of each row, or all of them at 0
+void on_topk(t_markov *x, const t_floatarg k) {
+  x->top_k = k < 0 ? 0 : k;
+  shape(x);
+}
+
+// Starts or stops taking steps ahead on a worker thread, so a bang only pops
+// the next one
+void on_prefetch(t_markov *x, const t_floatarg on) {
+  if (x->model == NULL) return;
+
+  if (on == 0) {
+    pm_prefetch_free(x->prefetch);
+    x->prefetch = NULL;
+  } else if (x->prefetch == NULL) {
+    x->prefetch = pm_prefetch_new(PREFETCH_SIZE);
+    if (x->prefetch == NULL)
+      post("Error allocating memory for prefetch");
+    else
+      resume_prefetch(x);
+  }
+}
+
+// Moves this object's models, and smoothing, into tables placed by its
+// memory policy, which also places the models it loads from now on. Other
+// objects keep theirs, and the copies they share, until sent a policy too.
+static void place(t_markov *x) {
+  if (x->model == NULL) return;
+
+  pause_prefetch(x);
+  clone_pm(&x->model, &x->memory);
+  if (x->target != NULL && clone_pm(&x->target, &x->memory) != NULL)
+    pm_cursor_set_target(&x->cursor, x->target->pm);
+  if (x->smoother != NULL) {
+    pm_smoother *smoother = pm_smoother_new(x->model->pm, x->smoother->smooth);
+    if (smoother != NULL) {
+      pm_smoother_free(x->smoother);
+      x->smoother = smoother;
+    }
+  }
+  resume_prefetch(x);
+}
+
+// 0 for ordinary pages, 1 for transparent huge pages, 2 for reserved huge
+// pages falling back to transparent ones
+void on_hugepages(t_markov *x, const t_floatarg mode) {
+  x->memory.pages = mode >= 2   ? PM_PAGES_EXPLICIT
+                    : mode >= 1 ? PM_PAGES_TRANSPARENT
+                                : PM_PAGES_DEFAULT;
+  place(x);
+}
+
+// Spreads the tables across NUMA nodes with interleave, keeps them on one
+// with bind <node>, or leaves them to first touch with anything else
+void on_numa(t_markov *x, const t_symbol *policy, const t_floatarg node) {
+  if (strcmp(policy->s_name, "bind") == 0 && (node < 0 || node >= 64)) {
+    post("[markov ] numa: node %g out of range", node);
+    return;
+  }
+
+  if (strcmp(policy->s_name, "interleave") == 0)
+    x->memory.numa = PM_NUMA_INTERLEAVE;
+  else if (strcmp(policy->s_name, "bind") == 0)
+    x->memory.numa = PM_NUMA_BIND;
+  else
+    x->memory.numa = PM_NUMA_DEFAULT;
+  x->memory.node = node;
+  place(x);
+}
 
-  for (int i = 0; i < x->n_grams; ++i)
-    if (strcmp(x->grams[i], new_gram) == 0) {
-      x->curr_gram_i = i;
+void free_hmm(t_hmm *hmm) {
+  if (hmm == NULL) return;
+
+  pm_hmm_free(hmm->pm);
+  free(hmm->symbols);
+  free(hmm);
+}
+
+// Loads a core decoder and interns its observed symbols, or returns NULL
+t_hmm *load_hmm(const t_model *model, const char *csv_path, int latency) {
+  t_hmm *hmm = (t_hmm *)calloc(1, sizeof(t_hmm));
+  if (hmm == NULL) return NULL;
+
+  hmm->pm = pm_hmm_load_csv(model->pm, csv_path, latency, log_post, NULL);
+  if (hmm->pm == NULL) {
+    free_hmm(hmm);
+    return NULL;
+  }
+
+  hmm->symbols = (t_symbol **)malloc(hmm->pm->n_symbols * sizeof(t_symbol *));
+  if (hmm->symbols == NULL) {
+    post("Error loading emissions from %s", csv_path);
+    free_hmm(hmm);
+    return NULL;
+  }
+  for (int k = 0; k < hmm->pm->n_symbols; ++k)
+    hmm->symbols[k] = gensym(hmm->pm->symbols[k]);
+
+  return hmm;
+}
+
+// Loads emission probabilities to decode observations with, trailing the
+// newest observation by latency frames
+void on_emissions(t_markov *x, const t_symbol *t_sym,
+                  const t_floatarg latency) {
+  if (x->model == NULL) return;
+
+  free_hmm(x->hmm);
+  x->hmm = load_hmm(own_model(x), t_sym->s_name, latency < 1 ? 1 : latency);
+}
+
+void on_observe(t_markov *x, const t_symbol *symbol) {
+  t_hmm *hmm = x->hmm;
+  if (hmm == NULL) return;
+
+  int symbol_i = -1;
+  for (int k = 0; k < hmm->pm->n_symbols; ++k)
+    if (hmm->symbols[k] == symbol) {
+      symbol_i = k;
       break;
     }
 
-  return next_state_i;
+  const t_model *model = own_model(x);
+  int state_i;
+  if (pm_hmm_observe(model->pm, hmm->pm, symbol_i, &state_i) == -1) return;
+
+  outlet_symbol(x->out_hidden, model->state_symbols[state_i]);
+}
+
+// Outputs the log probability of a sequence of states, whose first order
+// states are the starting gram
+void on_score(t_markov *x, const t_symbol *s, int argc, const t_atom *argv) {
+  (void)s;
+  if (x->model == NULL) return;
+
+  pm_scorer scorer = {0, -1, 0};
+  float score = 0;
+  for (int i = 0; i < argc && score > LOG_ZERO; ++i) {
+    int state_i = argv[i].a_type == A_SYMBOL
+                      ? find_state(x->model, argv[i].a_w.w_symbol)
+                      : -1;
+    score += pm_score(x->model->pm, &scorer, state_i);
+  }
+
+  t_atom result;
+  SETFLOAT(&result, score > LOG_ZERO ? score : LOG_ZERO);
+  outlet_anything(x->out_info, x->s_score, 1, &result);
+}
+
+// Loads another model over the same order and number of states for classify
+// to score, or unloads them all when given no path
+void on_candidate(t_markov *x, const t_symbol *t_sym) {
+  if (x->model == NULL) return;
+
+  if (*t_sym->s_name == '\0') {
+    for (int i = 0; i < x->n_candidates; ++i)
+      free_pm(x->candidates[i].model);
+    free(x->candidates);
+    x->candidates = NULL;
+    x->n_candidates = 0;
+    return;
+  }
+
+  t_model *model =
+      load_pm(t_sym->s_name, x->model->pm->order, x->model->pm->n_states,
+              &x->memory);
+  if (model == NULL) return;
+
+  t_candidate *candidates = (t_candidate *)realloc(
+      x->candidates, (x->n_candidates + 1) * sizeof(t_candidate));
+  if (candidates == NULL) {
+    post("Error allocating memory for t_candidate");
+    free_pm(model);
+    return;
+  }
+
+  x->candidates = candidates;
+  x->candidates[x->n_candidates++] = (t_candidate){model, {0, -1, 0}, 0};
+}
+
+void on_decay(t_markov *x, const t_floatarg decay) {
+  x->decay = decay < 0 ? 0 : decay > 1 ? 1 : decay;
+}
+
+// Scores one incoming state under every candidate in a single pass and
+// outputs the index and score of the most likely. Unlisted transitions cost
+// CLASSIFY_FLOOR instead of ruling a candidate out for good.
+void on_classify(t_markov *x, const t_symbol *state) {
+  if (x->n_candidates == 0) return;
+
+  int best = 0;
+  for (int i = 0; i < x->n_candidates; ++i) {
+    t_candidate *candidate = &x->candidates[i];
+    float lp = pm_score(candidate->model->pm, &candidate->scorer,
+                        find_state(candidate->model, state));
+    candidate->score =
+        x->decay * candidate->score + (lp > CLASSIFY_FLOOR ? lp : CLASSIFY_FLOOR);
+    if (candidate->score > x->candidates[best].score) best = i;
+  }
+
+  t_atom result[2];
+  SETFLOAT(&result[0], best);
+  SETFLOAT(&result[1], x->candidates[best].score);
+  outlet_anything(x->out_info, x->s_classify, 2, result);
+}
+
+// Starts or stops recording transitions into a preallocated ring
+void on_trace(t_markov *x, const t_floatarg on) {
+  if (on != 0 && x->trace == NULL) {
+    x->trace = (t_trace_record *)malloc(TRACE_SIZE * sizeof(t_trace_record));
+    if (x->trace == NULL) {
+      post("Error allocating memory for trace");
+      return;
+    }
+    x->n_traced = 0;
+  }
+  x->tracing = on != 0;
+}
+
+// Writes the traced transitions, oldest first, after a header of the magic
+// "PMTR", a version, the record size and the record count as uint32_t
+void on_dump(t_markov *x, const t_symbol *t_sym) {
+  if (x->trace == NULL) {
+    post("[markov ] dump: nothing traced");
+    return;
+  }
+
+  FILE *file = fopen(t_sym->s_name, "wb");
+  if (file == NULL) {
+    post("Error opening file %s. %s", t_sym->s_name, strerror(errno));
+    return;
+  }
+
+  uint64_t n = x->n_traced < TRACE_SIZE ? x->n_traced : TRACE_SIZE;
+  uint64_t first = x->n_traced - n;
+  uint32_t header[3] = {TRACE_VERSION, sizeof(t_trace_record), (uint32_t)n};
+  int failed = fwrite(TRACE_MAGIC, 1, 4, file) != 4 ||
+               fwrite(header, sizeof(header), 1, file) != 1;
+
+  // The ring wraps at most once
+  uint64_t head = first % TRACE_SIZE;
+  uint64_t n_head = n < TRACE_SIZE - head ? n : TRACE_SIZE - head;
+  if (!failed && n_head > 0)
+    failed = fwrite(x->trace + head, sizeof(t_trace_record), n_head, file) !=
+             n_head;
+  if (!failed && n > n_head)
+    failed = fwrite(x->trace, sizeof(t_trace_record), n - n_head, file) !=
+             n - n_head;
+
+  if (fclose(file) != 0 || failed)
+    post("Error writing file %s. %s", t_sym->s_name, strerror(errno));
+}
+
+// Renumbers the model's grams so the rows the trace visits one after another
+// sit next to each other, then writes it to path, if given, as a CSV that
+// loads in that order
+void on_optimize(t_markov *x, const t_symbol *t_sym) {
+  if (x->model == NULL) return;
+  if (x->sections != NULL) {  // The trace mixes the grams of every part
+    post("[markov ] optimize: not while sections are loaded");
+    return;
+  }
+  if (x->trace == NULL || x->n_traced == 0) {
+    post("[markov ] optimize: nothing traced");
+    return;
+  }
+
+  uint64_t n = x->n_traced < TRACE_SIZE ? x->n_traced : TRACE_SIZE;
+  uint64_t first = x->n_traced - n;
+  int64_t *visits = (int64_t *)malloc(n * sizeof(int64_t));
+  int64_t *where = NULL;
+  if (visits != NULL) {
+    for (uint64_t i = 0; i < n; ++i)
+      visits[i] = x->trace[(first + i) % TRACE_SIZE].gram_i;
+    where = pm_model_visit_order(x->model->pm, visits, n);
+  }
+  free(visits);
+  if (where == NULL) {
+    post("Error allocating memory for optimize");
+    return;
+  }
+
+  pause_prefetch(x);
+  pm_model *edited = edit_pm(&x->model);
+  if (edited != NULL && pm_model_reorder(edited, where))
+    post("Error allocating memory for optimize");
+  else if (edited != NULL) {
+    if (x->cursor.gram_i != -1) x->cursor.gram_i = where[x->cursor.gram_i];
+    for (uint64_t i = 0; i < n; ++i) {
+      t_trace_record *record = &x->trace[(first + i) % TRACE_SIZE];
+      if (record->gram_i != -1) record->gram_i = where[record->gram_i];
+    }
+    if (x->smoother != NULL) pm_smoother_update(x->smoother, edited);
+    if (x->hmm != NULL) pm_hmm_reorder(x->hmm->pm, edited, where);
+  }
+  resume_prefetch(x);
+  free(where);
+
+  if (edited != NULL && *t_sym->s_name)
+    pm_model_write_csv(edited, t_sym->s_name, log_post, NULL);
+}
+
+// Gives up on a running analyze and drops what it holds
+static void stop_analysis(t_markov *x) {
+  clock_unset(x->analyze_clock);
+  pm_analyzer_free(x->analyzer);
+  x->analyzer = NULL;
+  free_pm(x->analyzed_model);
+  free_pm(x->analyzed_target);
+  pm_smoother_free(x->analyzed_smoother);
+  x->analyzed_model = NULL;
+  x->analyzed_target = NULL;
+  x->analyzed_smoother = NULL;
+}
+
+static void output_analysis(t_markov *x, const t_model *analyzed,
+                            const pm_analysis *a) {
+  const pm_model *model = analyzed->pm;
+  t_atom result[3];
+  SETSYMBOL(&result[0], gensym("steps"));
+  SETFLOAT(&result[1], a->n_steps);
+  outlet_anything(x->out_info, x->s_analyze, 2, result);
+
+  SETSYMBOL(&result[0], gensym("visits"));
+  for (int j = 0; j < a->n_states; ++j) {
+    SETSYMBOL(&result[1], analyzed->state_symbols[j]);
+    SETFLOAT(&result[2], a->n_steps > 0
+                             ? (double)a->state_visits[j] / a->n_steps
+                             : 0);
+    outlet_anything(x->out_info, x->s_analyze, 3, result);
+  }
+
+  t_atom hitting[4];
+  SETSYMBOL(&hitting[0], gensym("hitting"));
+  if (a->hitting_counts == NULL)
+    post("[markov ] analyze: too many states for hitting times");
+  for (int from = 0; a->hitting_counts != NULL && from < a->n_states; ++from)
+    for (int to = 0; to < a->n_states; ++to) {
+      const int64_t pair = (int64_t)from * a->n_states + to;
+      if (a->hitting_counts[pair] == 0) continue;
+      SETSYMBOL(&hitting[1], analyzed->state_symbols[from]);
+      SETSYMBOL(&hitting[2], analyzed->state_symbols[to]);
+      SETFLOAT(&hitting[3], a->hitting_sums[pair] / a->hitting_counts[pair]);
+      outlet_anything(x->out_info, x->s_analyze, 4, hitting);
+    }
+
+  SETSYMBOL(&result[0], gensym("deadend"));
+  for (int64_t g = 0; g < model->n_grams; ++g)
+    if (a->dead_ends[g] > 0) {
+      SETSYMBOL(&result[1], gensym(model->grams[g]));
+      SETFLOAT(&result[2], a->dead_ends[g]);
+      outlet_anything(x->out_info, x->s_analyze, 3, result);
+    }
+  if (a->n_lost > 0) {
+    SETSYMBOL(&result[0], gensym("lost"));
+    SETFLOAT(&result[1], a->n_lost);
+    outlet_anything(x->out_info, x->s_analyze, 2, result);
+  }
+
+  SETSYMBOL(&result[0], gensym("absorbing"));
+  for (int64_t g = 0; g < model->n_grams; ++g)
+    if (pm_model_is_absorbing(model, g)) {
+      SETSYMBOL(&result[1], gensym(model->grams[g]));
+      outlet_anything(x->out_info, x->s_analyze, 2, result);
+    }
+}
+
+// Outputs the results of analyze once its threads finish
+static void on_analyze_tick(t_markov *x) {
+  pm_analysis *a;
+  if (!pm_analyzer_poll(x->analyzer, &a)) {
+    clock_delay(x->analyze_clock, ANALYZE_PERIOD);
+    return;
+  }
+
+  if (a == NULL)
+    post("Error allocating memory for analyze");
+  else
+    output_analysis(x, x->analyzed_model, a);
+  pm_analysis_free(a);
+  stop_analysis(x);
+}
+
+// Simulates runs of up to steps transitions from the current state, sampled
+// as bangs would be, on every core. Runs off the scheduler, then outputs
+// "analyze" messages: steps taken, visits <state> <share of samples>,
+// hitting <from> <to> <mean steps>, deadend <gram> <runs stopped there>,
+// lost <runs stopped off any gram> and absorbing <gram>.
+void on_analyze(t_markov *x, const t_floatarg runs, const t_floatarg steps) {
+  if (x->model == NULL) return;
+  if (!(runs >= 1) || !(steps >= 1)) {
+    post("[markov ] analyze: expects <runs> <steps> of at least 1");
+    return;
+  }
+  if (x->analyzer != NULL) {
+    post("[markov ] analyze: still running");
+    return;
+  }
+
+  // The runs get smoothing of their own, since edits update the object's
+  // in place
+  pm_smoother *smoother = NULL;
+  if (x->smoother != NULL) {
+    smoother = pm_smoother_new(x->model->pm, x->smoother->smooth);
+    int failed = smoother == NULL;
+    for (int m = 0; !failed && x->cursor.shaped && m < smoother->order; ++m)
+      failed = pm_model_rank(smoother->marginals[m]);
+    if (failed) {
+      post("Error allocating memory for analyze");
+      pm_smoother_free(smoother);
+      return;
+    }
+  }
+
+  long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  x->analyzer = pm_analyzer_start(x->model->pm, core(x->target), smoother,
+                                  &x->cursor, runs, steps,
+                                  n_threads > 0 ? n_threads : 1);
+  if (x->analyzer == NULL) {
+    post("Error starting the analyze thread");
+    pm_smoother_free(smoother);
+    return;
+  }
+  x->analyzed_model = x->model;
+  ++x->model->n_refs;
+  x->analyzed_target = x->target;
+  if (x->target != NULL) ++x->target->n_refs;
+  x->analyzed_smoother = smoother;
+  clock_delay(x->analyze_clock, ANALYZE_PERIOD);
+}
+
+// Swaps in a model whose states or grams changed, keeping the mutes, the
+// cursor's state history and smoothing. Gram indices all change, so the
+// decoder and the trace are dropped.
+static void replace_model(t_markov *x, pm_model *pm) {
+  t_model *model = wrap_pm(pm);
+  if (model == NULL) return;
+
+  for (int i = 0; i < pm->n_states; ++i)
+    if (x->model->pm->muted[i]) pm_model_mute(pm, i, 1);
+  if (x->cursor.shaped && pm_model_rank(pm))
+    post("Error allocating memory for ranks");
+  free_pm(x->model);
+  x->model = model;
+
+  if (x->target != NULL)
+    for (int i = 0; i < pm->n_states; ++i)
+      if (strcmp(x->target->pm->states[i], pm->states[i]) != 0) {
+        post("[markov ] watch: %s no longer lists the states of %s",
+             x->target->pm->csv_path, pm->csv_path);
+        load_target(x, &s_);
+        break;
+      }
+  pm_cursor_set_key(&x->cursor, pm, core(x->target), x->cursor.key);
+
+  if (x->smoother != NULL) {
+    pm_smoother *smoother = pm_smoother_new(pm, x->smoother->smooth);
+    if (smoother != NULL) {
+      pm_smoother_free(x->smoother);
+      x->smoother = smoother;
+      for (int m = 0; x->cursor.shaped && m < smoother->order; ++m)
+        if (pm_model_rank(smoother->marginals[m]))
+          post("Error allocating memory for ranks");
+    } else {  // The old one's tables follow the old grams
+      post("Error allocating memory for smoothing");
+      pm_smoother_free(x->smoother);
+      x->smoother = NULL;
+    }
+  }
+  settle_cursor(x);
+
+  if (x->hmm != NULL) {
+    post("[markov ] watch: the grams of %s changed, dropping emissions",
+         pm->csv_path);
+    free_hmm(x->hmm);
+    x->hmm = NULL;
+  }
+  x->n_traced = 0;
+}
+
+// Applies a model watch reloaded: only the rows that changed are replaced,
+// unless its states or grams did
+static void reload(t_markov *x, pm_model *pm) {
+  pause_prefetch(x);
+  pm_model *edited = edit_pm(&x->model);
+  int64_t n_changed = edited != NULL ? pm_model_update(edited, pm) : -1;
+  if (n_changed == -1) {
+    post("[markov ] watch: reloaded %s", pm->csv_path);
+    replace_model(x, pm);
+  } else {
+    if (n_changed > 0)
+      post("[markov ] watch: %lld rows of %s changed", (long long)n_changed,
+           pm->csv_path);
+    if (x->smoother != NULL) pm_smoother_update(x->smoother, edited);
+    pm_model_free(pm);
+  }
+  resume_prefetch(x);
+}
+
+// A reload waits while a section's part plays
+static void on_watch_tick(t_markov *x) {
+  pm_model *pm = own_model(x) == x->model ? pm_watch_take(x->watch) : NULL;
+  if (pm != NULL) reload(x, pm);
+  clock_delay(x->watch_clock, WATCH_PERIOD);
+}
+
+// Starts or stops reloading the model whenever its CSV changes. The file is
+// parsed on a thread of its own; comparing its rows, and copying the model
+// first if other objects share it, still run on the scheduler.
+void on_watch(t_markov *x, const t_floatarg on) {
+  if (x->model == NULL) return;
+
+  if (on == 0) {
+    clock_unset(x->watch_clock);
+    pm_watch_free(x->watch);
+    x->watch = NULL;
+  } else if (x->watch == NULL) {
+    const pm_model *model = own_model(x)->pm;
+    x->watch = pm_watch_new(model->csv_path, model->order, model->n_states,
+                            &model->memory);
+    if (x->watch == NULL)
+      post("Error starting the watch thread");
+    else
+      clock_delay(x->watch_clock, WATCH_PERIOD);
+  }
+}
+
+// Lends a part's model and smoothing to the sampler, taking back the ones
+// lent before. Smoothing and ranks are only built the first time a part
+// plays under the current settings, so later switches never allocate.
+static void swap_part(t_markov *x, int part_i) {
+  if (part_i == x->part_i) return;
+
+  const float smooth = x->smoother != NULL ? x->smoother->smooth : 0;
+  pause_prefetch(x);
+  const pm_model *outgoing = x->model->pm;
+  t_model *incoming = x->parts[part_i].model;
+  for (int i = 0; i < outgoing->n_states; ++i)
+    if (incoming->pm->muted[i] != outgoing->muted[i] &&
+        edit_pm(&incoming) != NULL)
+      pm_model_mute(incoming->pm, i, outgoing->muted[i]);
+  x->parts[x->part_i] = (t_part){x->model, x->smoother};
+  x->model = incoming;
+  x->smoother = x->parts[part_i].smoother;
+  x->parts[part_i] = (t_part){NULL, NULL};
+  x->part_i = part_i;
+
+  const pm_model *model = x->model->pm;
+  if (!(smooth > 0)) {
+    pm_smoother_free(x->smoother);
+    x->smoother = NULL;
+  } else if (x->smoother == NULL) {
+    x->smoother = pm_smoother_new(model, smooth);
+    if (x->smoother == NULL) post("Error allocating memory for smoothing");
+  } else if (x->smoother->smooth != smooth ||
+             x->smoother->revision != model->revision) {
+    x->smoother->smooth = smooth;
+    pm_smoother_update(x->smoother, model);
+  }
+  if (x->cursor.shaped) rank_models(x);
+  pm_cursor_set_key(&x->cursor, model, core(x->target), x->cursor.key);
+  settle_cursor(x);
+  resume_prefetch(x);
+}
+
+// Switches to the part of a section, or the object's own model if it has
+// none, and outputs "section" and its name
+static void play_section(t_markov *x, int section_i) {
+  const int own_i = x->sections->pm->n_states;
+  swap_part(x, x->part_i == section_i || x->parts[section_i].model != NULL
+                   ? section_i
+                   : own_i);
+
+  t_atom name;
+  SETSYMBOL(&name, x->sections->state_symbols[section_i]);
+  outlet_anything(x->out_info, x->s_section, 1, &name);
+}
+
+static void free_sections(t_markov *x) {
+  if (x->sections == NULL) return;
+
+  const int own_i = x->sections->pm->n_states;
+  swap_part(x, own_i);
+  for (int i = 0; i < own_i; ++i) {
+    free_pm(x->parts[i].model);
+    pm_smoother_free(x->parts[i].smoother);
+  }
+  free(x->parts);
+  x->parts = NULL;
+  free_pm(x->sections);
+  x->sections = NULL;
+}
+
+// Loads a chain whose n states are sections, each sampled from its own
+// part, or unloads it and every part when given no path
+void on_sections(t_markov *x, const t_symbol *t_sym, const t_floatarg order,
+                 const t_floatarg n_sections) {
+  if (x->model == NULL) return;
+
+  free_sections(x);
+  if (*t_sym->s_name == '\0') return;
+
+  t_model *sections = load_pm(t_sym->s_name, order, n_sections, &x->memory);
+  if (sections == NULL) return;
+  x->parts = (t_part *)calloc(sections->pm->n_states + 1, sizeof(t_part));
+  if (x->parts == NULL) {
+    post("Error allocating memory for sections");
+    free_pm(sections);
+    return;
+  }
+  x->sections = sections;
+  x->part_i = sections->pm->n_states;
+  pm_cursor_init(&x->section_cursor, sections->pm, NULL, random_seed());
+}
+
+// Loads the model a section plays, over the object's states, or unloads it
+// when given no path
+void on_part(t_markov *x, const t_symbol *section, const t_symbol *t_sym) {
+  if (x->sections == NULL) {
+    post("[markov ] part: no sections loaded");
+    return;
+  }
+  const int section_i = find_state(x->sections, section);
+  if (section_i == -1) {
+    post("[markov ] part: no section %s", section->s_name);
+    return;
+  }
+
+  const pm_model *own = own_model(x)->pm;
+  t_model *part = NULL;
+  if (*t_sym->s_name != '\0') {
+    part = load_pm(t_sym->s_name, own->order, own->n_states, &x->memory);
+    if (part == NULL) return;
+    for (int i = 0; i < own->n_states; ++i)
+      if (strcmp(part->pm->states[i], own->states[i]) != 0) {
+        post("Error: %s does not list the states of %s in the same order",
+             part->pm->csv_path, own->csv_path);
+        free_pm(part);
+        return;
+      }
+  }
+
+  const int playing = x->part_i == section_i;
+  if (playing) swap_part(x, x->sections->pm->n_states);
+  free_pm(x->parts[section_i].model);
+  pm_smoother_free(x->parts[section_i].smoother);
+  x->parts[section_i] = (t_part){part, NULL};
+  if (playing && part != NULL) swap_part(x, section_i);
+}
+
+// Samples the next section and switches to its part
+void on_next(t_markov *x) {
+  if (x->sections == NULL) return;
+
+  int section_i = pm_step(x->sections->pm, NULL, &x->section_cursor);
+  if (section_i != -1) play_section(x, section_i);
+}
+
+// Moves the chain of sections to one as if it had been sampled
+void on_section(t_markov *x, const t_symbol *section) {
+  if (x->sections == NULL) return;
+
+  const pm_model *sections = x->sections->pm;
+  const int section_i = find_state(x->sections, section);
+  if (section_i == -1) {
+    post("[markov ] section: no section %s", section->s_name);
+    return;
+  }
+  pm_cursor_set_key(&x->section_cursor, sections, NULL,
+                    x->section_cursor.key << sections->state_bits |
+                        (uint64_t)section_i);
+  pm_cursor_settle(&x->section_cursor, sections, NULL);
+  play_section(x, section_i);
+}
+
+// Outputs "best", the log probability and the states of each of the k most
+// likely phrases of n states from the current gram, most likely first,
+// under the model alone
+void on_best(t_markov *x, const t_floatarg n, const t_floatarg k) {
+  if (x->model == NULL) return;
+  if (!(n >= 1) || !(k >= 1)) {
+    post("[markov ] best: expects <N> <k> of at least 1");
+    return;
+  }
+
+  const int n_steps = n;
+  const int n_phrases = k;
+  int *states = (int *)malloc((size_t)n_phrases * n_steps * sizeof(int));
+  float *log_probabilities = (float *)malloc(n_phrases * sizeof(float));
+  t_atom *phrase = (t_atom *)malloc((n_steps + 1) * sizeof(t_atom));
+  int n_found = -1;
+  if (states != NULL && log_probabilities != NULL && phrase != NULL)
+    n_found = pm_best(x->model->pm, x->cursor.gram_i, n_steps, n_phrases,
+                      n_phrases > BEST_BEAM ? n_phrases : BEST_BEAM, states,
+                      log_probabilities);
+  if (n_found == -1) post("Error allocating memory for best");
+  if (n_found == 0) post("[markov ] best: no phrase of %d from here", n_steps);
+
+  for (int i = 0; i < n_found; ++i) {
+    SETFLOAT(&phrase[0], log_probabilities[i]);
+    for (int step = 0; step < n_steps; ++step)
+      SETSYMBOL(&phrase[step + 1],
+                x->model->state_symbols[states[(size_t)i * n_steps + step]]);
+    outlet_anything(x->out_info, x->s_best, n_steps + 1, phrase);
+  }
+  free(states);
+  free(log_probabilities);
+  free(phrase);
 }
 
 void on_bang(t_markov *x) {
-  outlet_symbol(x->out_state, gensym(x->states[transition(x)]));
+  if (x->model == NULL) return;
+
+  int next_state_i = transition(x);
+  if (next_state_i != -1)
+    outlet_symbol(x->out_state, x->model->state_symbols[next_state_i]);
 }
 
 void *init(const t_symbol *t_sym, const t_floatarg t_fl1,
@@ -143,32 +1386,55 @@ void *init(const t_symbol *t_sym, const t_floatarg t_fl1,
   t_markov *x = (t_markov *)pd_new(markov_class);
 
   x->out_state = outlet_new(&x->x_obj, &s_symbol);
-  x->csv_path = t_sym->s_name;
-  x->order = t_fl1;
-  x->n_states = t_fl2;
-  x->n_grams = pow(x->n_states, x->order);
+  x->out_hidden = outlet_new(&x->x_obj, &s_symbol);
+  x->out_info = outlet_new(&x->x_obj, &s_anything);
+  x->s_score = gensym("score");
+  x->s_classify = gensym("classify");
+  x->s_analyze = gensym("analyze");
+  x->s_section = gensym("section");
+  x->s_best = gensym("best");
+  x->watch_clock = clock_new(x, (t_method)on_watch_tick);
+  x->analyze_clock = clock_new(x, (t_method)on_analyze_tick);
+  x->memory = (pm_memory){PM_PAGES_DEFAULT, PM_NUMA_DEFAULT, 0};
+#ifdef PM_STATIC_MODEL
+  if (*t_sym->s_name == '\0') {  // No arguments: the compiled-in model
+    pm_model_link(&markov_model);
+    x->model = wrap_pm(&markov_model);
+  } else
+#endif
+    x->model = load_pm(t_sym->s_name, t_fl1, t_fl2, &x->memory);
+  x->target = NULL;
 
-  csv_to_pm(x, t_sym->s_name);
-
-  x->curr_gram_i = 0;
+  if (x->model != NULL)
+    pm_cursor_init(&x->cursor, x->model->pm, NULL, random_seed());
+  x->history =
+      (t_history_record *)malloc(HISTORY_SIZE * sizeof(t_history_record));
+  if (x->history == NULL) post("Error allocating memory for history");
+  on_morph(x, 0);
+  on_decay(x, 1);
+  on_temperature(x, 1);
 
   return x;
 }
 
 void destroy(t_markov *x) {
-  if (x->states != NULL)
-    for (int i = 0; i < x->n_states; ++i) free(x->states[i]);
-  free(x->states);
-
-  if (x->grams != NULL)
-    for (int i = 0; i < x->n_grams; ++i) free(x->grams[i]);
-  free(x->grams);
-
-  if (x->probabilities != NULL)
-    for (int i = 0; i < x->n_grams; ++i) free(x->probabilities[i]);
-  free(x->probabilities);
+  stop_analysis(x);
+  clock_free(x->analyze_clock);
+  pm_watch_free(x->watch);
+  clock_free(x->watch_clock);
+  free_sections(x);
+  pm_prefetch_free(x->prefetch);
+  free_pm(x->model);
+  free_pm(x->target);
+  pm_smoother_free(x->smoother);
+  free_hmm(x->hmm);
+  on_candidate(x, &s_);
+  free(x->trace);
+  free(x->history);
 
   outlet_free(x->out_state);
+  outlet_free(x->out_hidden);
+  outlet_free(x->out_info);
 
   post("Destroyed t_markov");
 }
@@ -182,6 +1448,62 @@ void markov_setup() {
                            0);
 
   class_addbang(markov_class, (t_method)on_bang);
+  class_addmethod(markov_class, (t_method)on_set, gensym("set"), A_GIMME, 0);
+  class_addmethod(markov_class, (t_method)on_reset, gensym("reset"), 0);
+  class_addmethod(markov_class, (t_method)on_rewind, gensym("rewind"),
+                  A_DEFFLOAT, 0);
+  class_addmethod(markov_class, (t_method)on_branch, gensym("branch"), 0);
+  class_addmethod(markov_class, (t_method)on_mute, gensym("mute"), A_SYMBOL,
+                  0);
+  class_addmethod(markov_class, (t_method)on_unmute, gensym("unmute"),
+                  A_SYMBOL, 0);
+  class_addmethod(markov_class, (t_method)on_target, gensym("target"),
+                  A_DEFSYMBOL, 0);
+  class_addmethod(markov_class, (t_method)on_morph, gensym("morph"), A_FLOAT,
+                  0);
+  class_addmethod(markov_class, (t_method)on_smooth, gensym("smooth"), A_FLOAT,
+                  0);
+  class_addmethod(markov_class, (t_method)on_temperature,
+                  gensym("temperature"), A_FLOAT, 0);
+  class_addmethod(markov_class, (t_method)on_topk, gensym("topk"), A_FLOAT,
+                  0);
+  class_addmethod(markov_class, (t_method)on_prefetch, gensym("prefetch"),
+                  A_FLOAT, 0);
+  class_addmethod(markov_class, (t_method)on_hugepages, gensym("hugepages"),
+                  A_FLOAT, 0);
+  class_addmethod(markov_class, (t_method)on_numa, gensym("numa"), A_SYMBOL,
+                  A_DEFFLOAT, 0);
+  class_addmethod(markov_class, (t_method)on_emissions, gensym("emissions"),
+                  A_SYMBOL, A_DEFFLOAT, 0);
+  class_addmethod(markov_class, (t_method)on_observe, gensym("observe"),
+                  A_SYMBOL, 0);
+  class_addmethod(markov_class, (t_method)on_score, gensym("score"), A_GIMME,
+                  0);
+  class_addmethod(markov_class, (t_method)on_candidate, gensym("candidate"),
+                  A_DEFSYMBOL, 0);
+  class_addmethod(markov_class, (t_method)on_decay, gensym("decay"), A_FLOAT,
+                  0);
+  class_addmethod(markov_class, (t_method)on_classify, gensym("classify"),
+                  A_SYMBOL, 0);
+  class_addmethod(markov_class, (t_method)on_trace, gensym("trace"), A_FLOAT,
+                  0);
+  class_addmethod(markov_class, (t_method)on_dump, gensym("dump"), A_SYMBOL,
+                  0);
+  class_addmethod(markov_class, (t_method)on_sections, gensym("sections"),
+                  A_DEFSYMBOL, A_DEFFLOAT, A_DEFFLOAT, 0);
+  class_addmethod(markov_class, (t_method)on_part, gensym("part"), A_SYMBOL,
+                  A_DEFSYMBOL, 0);
+  class_addmethod(markov_class, (t_method)on_next, gensym("next"), 0);
+  class_addmethod(markov_class, (t_method)on_section, gensym("section"),
+                  A_SYMBOL, 0);
+  class_addmethod(markov_class, (t_method)on_watch, gensym("watch"), A_FLOAT,
+                  0);
+  class_addmethod(markov_class, (t_method)on_best, gensym("best"), A_FLOAT,
+                  A_FLOAT, 0);
+  class_addmethod(markov_class, (t_method)on_analyze, gensym("analyze"),
+                  A_FLOAT, A_FLOAT, 0);
+  class_addmethod(markov_class, (t_method)on_optimize, gensym("optimize"),
+                  A_DEFSYMBOL, 0);
 
   class_sethelpsymbol(markov_class, gensym("markov"));
-}
\ No newline at end of file
+}
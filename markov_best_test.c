@@ -0,0 +1,128 @@
+// Checks pm_best against brute force on a sparse model written to a
+// temporary CSV: half the grams listed, a third of each row zero. Every
+// phrase from every gram is scored by walking gram keys, staying on a gram
+// whose next is unlisted, and the k best must match.
+//
+// Usage: markov_best_test
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "markov_core.h"
+
+#define N_STATES 12
+#define ORDER 2
+#define N_STEPS 4
+#define K 5
+#define BEAM 1024
+#define TOLERANCE 1e-4f
+
+static void log_stderr(void *user, const char *message) {
+  (void)user;
+  fprintf(stderr, "%s\n", message);
+}
+
+static uint64_t seed = 1;
+
+static uint32_t next_random(void) {
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return seed >> 33;
+}
+
+static int write_model(FILE *file) {
+  fprintf(file, "Gram");
+  for (int j = 0; j < N_STATES; ++j) fprintf(file, ",%c", 'A' + j);
+  fprintf(file, "\n");
+  for (int a = 0; a < N_STATES; ++a)
+    for (int b = 0; b < N_STATES; ++b) {
+      if (next_random() % 2) continue;
+      fprintf(file, "%c%c", 'A' + a, 'A' + b);
+      for (int j = 0; j < N_STATES; ++j)
+        fprintf(file, ",%g", next_random() % 3 ? next_random() % 100 : 0.0);
+      fprintf(file, "\n");
+    }
+  return fflush(file);
+}
+
+static int by_score(const void *a, const void *b) {
+  const float x = *(const float *)a, y = *(const float *)b;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Scores the phrase of n_steps states, or returns PM_LOG_ZERO if a step
+// cannot be sampled
+static float score(const pm_model *model, int64_t gram_i, const int *states,
+                   int n_steps) {
+  float total = 0;
+  for (int t = 0; t < n_steps; ++t) {
+    const float lp = pm_log_probability(model, gram_i, states[t]);
+    if (!(lp > PM_LOG_ZERO)) return PM_LOG_ZERO;
+    total += lp;
+    const uint64_t key =
+        ((model->gram_keys[gram_i] << model->state_bits) | states[t]) &
+        model->gram_mask;
+    const int64_t next = pm_model_find_gram(model, key);
+    if (next != -1) gram_i = next;
+  }
+  return total;
+}
+
+// Scores of every phrase from gram_i that can be sampled, most likely first
+static int brute_force(const pm_model *model, int64_t gram_i, float *scores) {
+  int n = 0;
+  int states[N_STEPS];
+  long n_phrases = 1;
+  for (int t = 0; t < N_STEPS; ++t) n_phrases *= N_STATES;
+  for (long phrase = 0; phrase < n_phrases; ++phrase) {
+    for (int t = 0, rest = phrase; t < N_STEPS; ++t, rest /= N_STATES)
+      states[t] = rest % N_STATES;
+    const float s = score(model, gram_i, states, N_STEPS);
+    if (s > PM_LOG_ZERO) scores[n++] = s;
+  }
+  qsort(scores, n, sizeof(float), by_score);
+  return n;
+}
+
+int main(void) {
+  char path[] = "/tmp/markov_best_test_XXXXXX";
+  const int fd = mkstemp(path);
+  FILE *file = fd != -1 ? fdopen(fd, "w") : NULL;
+  if (file == NULL || write_model(file)) {
+    fprintf(stderr, "Error writing %s\n", path);
+    return 1;
+  }
+  pm_model *model =
+      pm_model_load_csv(path, ORDER, N_STATES, NULL, log_stderr, NULL);
+  fclose(file);
+  unlink(path);
+  if (model == NULL) return 1;
+
+  float *scores =
+      (float *)malloc((size_t)pow(N_STATES, N_STEPS) * sizeof(float));
+  if (scores == NULL) return 1;
+  int states[K * N_STEPS];
+  float found[K];
+  int n_failed = 0, n_phrases = 0;
+  for (int64_t g = 0; g < model->n_grams; ++g) {
+    const int n_expected = brute_force(model, g, scores);
+    const int n_found = pm_best(model, g, N_STEPS, K, BEAM, states, found);
+    int failed = n_found != (n_expected < K ? n_expected : K);
+    for (int i = 0; i < n_found && !failed; ++i)
+      failed = fabsf(found[i] - scores[i]) > TOLERANCE ||
+               fabsf(score(model, g, states + i * N_STEPS, N_STEPS) -
+                     found[i]) > TOLERANCE;
+    if (failed)
+      printf("%s: %d of %d phrases found, or scored apart\n",
+             model->grams[g], n_found, n_expected < K ? n_expected : K);
+    n_failed += failed;
+    n_phrases += n_found;
+  }
+
+  printf("%lld grams listed of %d, %d phrases checked\n",
+         (long long)model->n_grams, N_STATES * N_STATES, n_phrases);
+  free(scores);
+  pm_model_free(model);
+  puts(n_failed ? "FAILED: best differs from brute force" : "OK");
+  return n_failed != 0;
+}
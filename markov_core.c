@@ -0,0 +1,2573 @@
+#include "markov_core.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define DELIMITERS ",;\n"
+#define MAX_LINE_SIZE 1024
+#define MAX_MESSAGE_SIZE 1024
+#define MAX_DENSE_KEY_BITS 16  // Widest gram key looked up without hashing
+#define PREFETCH_PREFILL 64     // Steps taken before the worker starts
+#define PREFETCH_IDLE_NS 100000  // Worker sleep while the ring is full
+#define HUGE_PAGE_SIZE (2 << 20)  // Tables this large are mapped directly
+#define TABLE_OFFSET 64  // Header before a table, keeping it 64-byte aligned
+#define MAX_NAME_SEED (1 << 20)  // Seeds a bucket of gram names may try
+#define WATCH_POLL_NS 250000000  // Between two looks at a watched file
+#define ANALYSIS_MAX_BYTES ((int64_t)1 << 30)  // Hitting tables of all threads
+#define ANALYSIS_STOP_MASK 0xffff  // Steps between checks for a cancel
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#ifdef __APPLE__
+#define MTIME_NSEC(s) ((s)->st_mtimespec.tv_nsec)
+#else
+#define MTIME_NSEC(s) ((s)->st_mtim.tv_nsec)
+#endif
+
+static void report(pm_log_fn log, void *user, const char *format, ...) {
+  if (log == NULL) return;
+
+  char message[MAX_MESSAGE_SIZE];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+  log(user, message);
+}
+
+static uint64_t hash_key(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+int pm_map_init(pm_map *map, uint64_t capacity) {
+  map->keys = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+  map->values = (int64_t *)malloc(capacity * sizeof(int64_t));
+  if (map->keys == NULL || map->values == NULL) return 1;
+
+  for (uint64_t i = 0; i < capacity; ++i) map->values[i] = -1;
+  map->mask = capacity - 1;
+  map->size = 0;
+  return 0;
+}
+
+void pm_map_free(pm_map *map) {
+  free(map->keys);
+  free(map->values);
+  map->keys = NULL;
+  map->values = NULL;
+}
+
+int64_t pm_map_get(const pm_map *map, uint64_t key) {
+  if (map->values == NULL) return -1;
+
+  for (uint64_t i = hash_key(key) & map->mask;; i = (i + 1) & map->mask) {
+    if (map->values[i] == -1) return -1;
+    if (map->keys[i] == key) return map->values[i];
+  }
+}
+
+int pm_map_put(pm_map *map, uint64_t key, int64_t value) {
+  if (2 * (map->size + 1) > (int64_t)(map->mask + 1)) {  // Grow at 1/2 load
+    pm_map grown;
+    if (pm_map_init(&grown, 2 * (map->mask + 1))) return 1;
+    for (uint64_t i = 0; i <= map->mask; ++i)
+      if (map->values[i] != -1)
+        pm_map_put(&grown, map->keys[i], map->values[i]);
+    pm_map_free(map);
+    *map = grown;
+  }
+
+  uint64_t i = hash_key(key) & map->mask;
+  while (map->values[i] != -1 && map->keys[i] != key) i = (i + 1) & map->mask;
+  if (map->values[i] == -1) ++map->size;
+  map->keys[i] = key;
+  map->values[i] = value;
+  return 0;
+}
+
+int pm_model_parse_gram(const pm_model *x, const char *gram, uint64_t *key) {
+  *key = 0;
+  for (int i = 0; i < x->order; ++i) {
+    int match = -1;
+    size_t match_len = 0;
+    for (int j = 0; j < x->n_states; ++j) {
+      size_t len = strlen(x->states[j]);
+      if (len > match_len && strncmp(gram, x->states[j], len) == 0) {
+        match = j;
+        match_len = len;
+      }
+    }
+
+    if (match == -1) return 1;
+    *key = (*key << x->state_bits) | (uint64_t)match;
+    gram += match_len;
+  }
+
+  return *gram != '\0';
+}
+
+static int csv_to_pm(pm_model *x, const char *csv_path, pm_log_fn log,
+                     void *user) {
+  FILE *file = fopen(csv_path, "r");
+  if (file == NULL) {
+    report(log, user, "Error opening file %s. %s", csv_path, strerror(errno));
+    return 1;
+  }
+
+  x->state_bits = 1;
+  while ((1 << x->state_bits) < x->n_states) ++x->state_bits;
+  if (x->order < 1 || x->n_states < 1 || x->order * x->state_bits > 64) {
+    report(log, user,
+           "Error: order %i over %i states does not fit a 64-bit gram key",
+           x->order, x->n_states);
+    fclose(file);
+    return 1;
+  }
+  x->gram_mask = x->order * x->state_bits == 64
+                     ? UINT64_MAX
+                     : (1ULL << (x->order * x->state_bits)) - 1;
+
+  int64_t capacity = 16;
+  x->states = (char **)calloc(x->n_states, sizeof(char *));
+  x->grams = (char **)malloc(capacity * sizeof(char *));
+  x->gram_keys = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+  x->probabilities = (float **)malloc(capacity * sizeof(float *));
+
+  if (x->states == NULL || x->grams == NULL || x->gram_keys == NULL ||
+      x->probabilities == NULL || pm_map_init(&x->gram_map, 2 * capacity)) {
+    report(log, user, "Error allocating memory for pm_model");
+    fclose(file);
+    return 1;
+  }
+
+  char line[MAX_LINE_SIZE];
+  int line_i = 0;
+
+  while (fgets(line, sizeof(line), file)) {
+    char *save;  // Reentrant, so a watch thread can parse alongside
+    char *token = strtok_r(line, DELIMITERS, &save);
+    int col_i = 0;
+    int64_t gram_i = -1;
+
+    while (token != NULL && col_i <= x->n_states) {
+      if (line_i == 0) {  // State
+        if (col_i > 0) x->states[col_i - 1] = strdup(token);
+      } else if (col_i == 0) {  // Gram
+        uint64_t key;
+        if (pm_model_parse_gram(x, token, &key)) {
+          report(log, user, "[markov ] skipping invalid gram %s", token);
+          break;
+        }
+        if (pm_map_get(&x->gram_map, key) != -1) {
+          report(log, user, "[markov ] skipping duplicate gram %s", token);
+          break;
+        }
+
+        if (x->n_grams == capacity) {
+          capacity *= 2;
+          char **grams = (char **)realloc(x->grams, capacity * sizeof(char *));
+          if (grams != NULL) x->grams = grams;
+          uint64_t *keys = (uint64_t *)realloc(x->gram_keys,
+                                               capacity * sizeof(uint64_t));
+          if (keys != NULL) x->gram_keys = keys;
+          float **probabilities = (float **)realloc(
+              x->probabilities, capacity * sizeof(float *));
+          if (probabilities != NULL) x->probabilities = probabilities;
+          if (grams == NULL || keys == NULL || probabilities == NULL) {
+            report(log, user, "Error allocating memory for pm_model");
+            fclose(file);
+            return 1;
+          }
+        }
+
+        gram_i = x->n_grams++;
+        x->n_rows = x->n_grams;  // One row per gram until deduplicated
+        x->grams[gram_i] = strdup(token);
+        x->gram_keys[gram_i] = key;
+        x->probabilities[gram_i] =
+            (float *)calloc(x->n_states, sizeof(float));
+        if (x->grams[gram_i] == NULL || x->probabilities[gram_i] == NULL ||
+            pm_map_put(&x->gram_map, key, gram_i)) {
+          report(log, user, "Error allocating memory for pm_model");
+          fclose(file);
+          return 1;
+        }
+      } else {  // Probability
+        x->probabilities[gram_i][col_i - 1] = atof(token);
+      }
+
+      token = strtok_r(NULL, DELIMITERS, &save);
+      ++col_i;
+    }
+
+    if (line_i == 0)
+      for (int i = 0; i < x->n_states; ++i)
+        if (x->states[i] == NULL) {
+          report(log, user, "Error: %s lists fewer than %i states", csv_path,
+                 x->n_states);
+          fclose(file);
+          return 1;
+        }
+
+    ++line_i;
+  }
+
+  fclose(file);
+
+  if (x->n_grams == 0) {
+    report(log, user, "Error: %s has no valid grams", csv_path);
+    return 1;
+  }
+
+  return 0;
+}
+
+static inline int64_t find_gram(const pm_model *model, uint64_t key) {
+  return model->gram_table != NULL ? model->gram_table[key]
+                                   : pm_map_get(&model->gram_map, key);
+}
+
+int64_t pm_model_find_gram(const pm_model *model, uint64_t key) {
+  return find_gram(model, key & model->gram_mask);
+}
+
+int pm_model_find_state(const pm_model *model, const char *state) {
+  for (int i = 0; i < model->n_states; ++i)
+    if (strcmp(model->states[i], state) == 0) return i;
+  return -1;
+}
+
+int pm_gram_state(const pm_model *model, int64_t gram_i) {
+  return model->gram_keys[gram_i] & ((1ULL << model->state_bits) - 1);
+}
+
+// Moves to the gram ending in next_state_i, staying put if no model lists it
+static inline void advance(const pm_model *model, const pm_model *target,
+                           pm_cursor *cursor, int next_state_i) {
+  uint64_t key =
+      ((cursor->key << model->state_bits) | (uint64_t)next_state_i) &
+      model->gram_mask;
+  int64_t next_gram_i =
+      cursor->gram_i != -1
+          ? model->successors[cursor->gram_i * model->row_width +
+                              next_state_i]
+          : find_gram(model, key);
+  int64_t next_target_gram_i = target != NULL ? find_gram(target, key) : -1;
+  if (next_gram_i != -1 || next_target_gram_i != -1) {
+    cursor->key = key;
+    cursor->gram_i = next_gram_i;
+    cursor->target_gram_i = next_target_gram_i;
+  }
+}
+
+// Index of the state whose cumulative weight range holds u, found by
+// descending a Fenwick tree over a power-of-two row width
+static inline int fenwick_find(const float *tree, int width, float u) {
+  int pos = 0;
+  for (int step = width / 2; step > 0; step >>= 1)
+    if (tree[pos + step - 1] <= u) {
+      pos += step;
+      u -= tree[pos - 1];
+    }
+  return pos;
+}
+
+static void fenwick_add(float *tree, int width, int state_i, float delta) {
+  for (int i = state_i + 1; i <= width; i += i & -i) tree[i - 1] += delta;
+}
+
+static inline int64_t gram_row(const pm_model *model, int64_t gram_i) {
+  return gram_i == -1 ? -1 : model->gram_rows[gram_i];
+}
+
+static inline float weight(const pm_model *model, int64_t row, int state_i) {
+  return model->muted[state_i] ? 0 : model->probabilities[row][state_i];
+}
+
+static inline float row_total(const pm_model *model, int64_t row) {
+  return row == -1 ? 0 : model->trees[(row + 1) * model->row_width - 1];
+}
+
+float pm_row_total(const pm_model *model, int64_t gram_i) {
+  return row_total(model, gram_row(model, gram_i));
+}
+
+// Samples a row with r in [0, 1), renormalizing by the row total so edits
+// and muted states never require rewriting the row
+static inline int sample(const pm_model *model, int64_t row, int width,
+                         float r) {
+  const float *tree = model->trees + row * width;
+  const float total = tree[width - 1];
+  if (!(total > 0)) return -1;
+
+  int state_i = fenwick_find(tree, width, r * total);
+  if (state_i < model->n_states && weight(model, row, state_i) > 0)
+    return state_i;
+
+  // Rounding ran past the last live state
+  if (state_i >= model->n_states) state_i = model->n_states - 1;
+  while (state_i >= 0 && !(weight(model, row, state_i) > 0)) --state_i;
+  return state_i;
+}
+
+// Samples the top_k most likely unmuted states of a row, reweighted to
+// p ** (1 / temperature), from its ranks and log weights. Two passes over at
+// most top_k states, or the row's live states if top_k is 0.
+static int sample_shaped(const pm_model *model, int64_t row,
+                         const pm_cursor *cursor, float r) {
+  const int32_t *ranks = model->ranks + row * model->row_width;
+  const float *log_weights = model->log_weights + row * model->row_width;
+  const int k = cursor->top_k > 0 ? cursor->top_k : model->n_states;
+
+  // Weights are relative to the most likely, so expf cannot overflow
+  float top = 0, total = 0;
+  int n = 0;
+  for (int i = 0; i < model->n_states && n < k; ++i) {
+    const int state_i = ranks[i];
+    if (!(log_weights[state_i] > PM_LOG_ZERO)) break;  // Zeros rank last
+    if (model->muted[state_i]) continue;
+    if (n++ == 0) top = log_weights[state_i];
+    total += expf((log_weights[state_i] - top) * cursor->inv_temperature);
+  }
+  if (n == 0) return -1;
+
+  float u = r * total;
+  int state_i = -1;
+  for (int i = 0, m = 0; m < n; ++i) {
+    if (model->muted[ranks[i]]) continue;
+    state_i = ranks[i];
+    ++m;
+    float w = expf((log_weights[state_i] - top) * cursor->inv_temperature);
+    if (u < w) break;
+    u -= w;
+  }
+  return state_i;  // Rounding past the last keeps it
+}
+
+static inline int draw_row(const pm_model *model, int64_t row, int width,
+                           const pm_cursor *cursor, float r) {
+  return cursor->shaped && model->ranks != NULL
+             ? sample_shaped(model, row, cursor, r)
+             : sample(model, row, width, r);
+}
+
+// Samples (1 - morph) * model + morph * target for the current gram by
+// flipping a coin between the two rows, falling back to whichever is live.
+// One 64-bit draw supplies both the coin and the sample.
+static inline int step(const pm_model *model, const pm_model *target,
+                       pm_cursor *cursor, int width) {
+  const uint64_t bits = pm_rng_next(&cursor->rng);
+  cursor->draw = bits >> 32;
+
+  const pm_model *rows = model;
+  int64_t row = gram_row(model, cursor->gram_i);
+  if (target != NULL) {
+    const int64_t target_row = gram_row(target, cursor->target_gram_i);
+    int use_target = (bits & 0xffffffff) < cursor->morph_threshold;
+    if (!(row_total(use_target ? target : model,
+                    use_target ? target_row : row) > 0))
+      use_target = !use_target;
+    if (use_target) {
+      rows = target;
+      row = target_row;
+    }
+  }
+  if (row == -1) return -1;
+
+  int next_state_i =
+      draw_row(rows, row, width, cursor, (cursor->draw >> 8) * 0x1p-24f);
+  if (next_state_i != -1) advance(model, target, cursor, next_state_i);
+  return next_state_i;
+}
+
+// Fixed-size kernels: the Fenwick descent over a row of constant width
+// unrolls into log2(W) branch-free steps.
+#define DEFINE_STEP(W)                                                  \
+  static int step_##W(const pm_model *model, const pm_model *target,    \
+                      pm_cursor *cursor) {                              \
+    return step(model, target, cursor, (W));                            \
+  }
+
+DEFINE_STEP(4)
+DEFINE_STEP(8)
+DEFINE_STEP(16)
+
+static int step_generic(const pm_model *model, const pm_model *target,
+                        pm_cursor *cursor) {
+  return step(model, target, cursor, model->row_width);
+}
+
+// Rebuilds the Fenwick tree of one row from its unmuted probabilities
+static void build_row(pm_model *model, int64_t row) {
+  const int width = model->row_width;
+  float *tree = model->trees + row * width;
+  for (int j = 0; j < width; ++j)
+    tree[j] = j < model->n_states ? weight(model, row, j) : 0;
+  for (int i = 1; i <= width; ++i)
+    if (i + (i & -i) <= width) tree[i + (i & -i) - 1] += tree[i - 1];
+}
+
+// Maps size bytes, a multiple of HUGE_PAGE_SIZE, on huge pages if asked and
+// available and on the NUMA nodes asked, or returns NULL
+static char *map_table(const pm_memory *memory, size_t size) {
+  char *block = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (memory->pages == PM_PAGES_EXPLICIT)
+    block = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (block == MAP_FAILED) {  // No reserved huge pages: fall back to THP
+    // Over-maps by a huge page to start on a huge page boundary
+    char *mapped = (char *)mmap(NULL, size + HUGE_PAGE_SIZE,
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) return NULL;
+    block = (char *)(((uintptr_t)mapped + HUGE_PAGE_SIZE - 1) &
+                     ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (block > mapped) munmap(mapped, block - mapped);
+    munmap(block + size, mapped + HUGE_PAGE_SIZE - block);
+#ifdef MADV_HUGEPAGE
+    if (memory->pages != PM_PAGES_DEFAULT)
+      madvise(block, size, MADV_HUGEPAGE);
+#endif
+  }
+
+#ifdef SYS_mbind
+  // Before the first touch, so pages are placed as they fault in. Calls the
+  // kernel directly rather than link libnuma; nodes not online are ignored.
+  if (memory->numa != PM_NUMA_DEFAULT) {
+    unsigned long nodes =
+        memory->numa == PM_NUMA_BIND ? 1UL << memory->node : ~0UL;
+    syscall(SYS_mbind, block, size,
+            memory->numa == PM_NUMA_BIND ? MPOL_BIND : MPOL_INTERLEAVE,
+            &nodes, sizeof(nodes) * 8 + 1, 0);
+  }
+#endif
+  return block;
+}
+
+// Allocates a 64-byte aligned table, placed by memory when it is large enough
+// to map on its own. Freed by free_table.
+static void *alloc_table(const pm_memory *memory, size_t size) {
+  char *block = NULL;
+  size_t mapped = 0;
+  if (size >= HUGE_PAGE_SIZE && (memory->pages != PM_PAGES_DEFAULT ||
+                                 memory->numa != PM_NUMA_DEFAULT)) {
+    mapped = (size + TABLE_OFFSET + HUGE_PAGE_SIZE - 1) &
+             ~(size_t)(HUGE_PAGE_SIZE - 1);
+    block = map_table(memory, mapped);
+  }
+  if (block == NULL) {
+    mapped = 0;
+    if (posix_memalign((void **)&block, 64, size + TABLE_OFFSET)) return NULL;
+  }
+
+  memcpy(block, &mapped, sizeof(mapped));
+  return block + TABLE_OFFSET;
+}
+
+static void free_table(void *table) {
+  if (table == NULL) return;
+
+  char *block = (char *)table - TABLE_OFFSET;
+  size_t mapped;
+  memcpy(&mapped, block, sizeof(mapped));
+  if (mapped > 0)
+    munmap(block, mapped);
+  else
+    free(block);
+}
+
+static float *alloc_floats(const pm_memory *memory, int64_t n) {
+  return (float *)alloc_table(memory, n * sizeof(float));
+}
+
+// Moves a table's first size bytes into a new one of capacity bytes.
+// Returns 1 if it cannot be allocated, leaving them in place.
+static int grow_table(const pm_memory *memory, void **table, size_t size,
+                      size_t capacity) {
+  void *grown = alloc_table(memory, capacity);
+  if (grown == NULL) return 1;
+
+  memcpy(grown, *table, size);
+  free_table(*table);
+  *table = grown;
+  return 0;
+}
+
+static uint64_t hash_row(const float *row, int n_states) {
+  uint64_t hash = 0;
+  for (int j = 0; j < n_states; ++j) {
+    uint32_t bits;
+    memcpy(&bits, &row[j], sizeof(bits));
+    hash = hash_key(hash ^ bits) + j;
+  }
+  return hash;
+}
+
+// Points grams with identical rows at a single copy, freeing the others.
+// Returns 1 if the row tables cannot be allocated.
+static int dedup_rows(pm_model *x) {
+  const size_t size = x->n_states * sizeof(float);
+  pm_map rows = {0};
+  x->gram_rows = (int64_t *)malloc(x->n_grams * sizeof(int64_t));
+  x->row_refs = (int64_t *)calloc(x->n_grams, sizeof(int64_t));
+  if (x->gram_rows == NULL || x->row_refs == NULL ||
+      pm_map_init(&rows, 16)) {
+    pm_map_free(&rows);
+    return 1;
+  }
+
+  // Rows move down as duplicates are dropped, so row <= i throughout
+  int64_t n_rows = 0;
+  int failed = 0;
+  for (int64_t i = 0; i < x->n_grams; ++i) {
+    float *probabilities = x->probabilities[i];
+    uint64_t hash = hash_row(probabilities, x->n_states);
+    int64_t row = pm_map_get(&rows, hash);
+    x->probabilities[i] = NULL;
+
+    if (row != -1 && memcmp(x->probabilities[row], probabilities, size) == 0) {
+      free(probabilities);
+    } else {  // Rows that only collide stay distinct
+      if (row == -1 && !failed) failed = pm_map_put(&rows, hash, n_rows);
+      row = n_rows++;
+      x->probabilities[row] = probabilities;
+    }
+    x->gram_rows[i] = row;
+    ++x->row_refs[row];
+  }
+  x->n_rows = n_rows;
+
+  pm_map_free(&rows);
+  return failed;
+}
+
+// Gives a gram its own copy of the row it shares, or returns -1
+static int64_t split_row(pm_model *model, int64_t gram_i) {
+  const int width = model->row_width;
+  if (model->n_rows == model->row_capacity) {
+    int64_t capacity = 2 * model->row_capacity;
+    if (capacity > model->n_grams) capacity = model->n_grams;
+    const size_t row_size = width * sizeof(float);
+    const pm_memory *memory = &model->memory;
+    if (grow_table(memory, (void **)&model->trees, model->n_rows * row_size,
+                   capacity * row_size) ||
+        grow_table(memory, (void **)&model->log_weights,
+                   model->n_rows * row_size, capacity * row_size) ||
+        grow_table(memory, (void **)&model->log_totals,
+                   model->n_rows * sizeof(float), capacity * sizeof(float)) ||
+        (model->ranks != NULL &&
+         grow_table(memory, (void **)&model->ranks,
+                    model->n_rows * width * sizeof(int32_t),
+                    capacity * width * sizeof(int32_t))))
+      return -1;
+    model->row_capacity = capacity;
+  }
+
+  const int64_t shared = model->gram_rows[gram_i];
+  const int64_t row = model->n_rows;
+  model->probabilities[row] = (float *)malloc(model->n_states * sizeof(float));
+  if (model->probabilities[row] == NULL) return -1;
+
+  memcpy(model->probabilities[row], model->probabilities[shared],
+         model->n_states * sizeof(float));
+  memcpy(model->trees + row * width, model->trees + shared * width,
+         width * sizeof(float));
+  memcpy(model->log_weights + row * width, model->log_weights + shared * width,
+         width * sizeof(float));
+  model->log_totals[row] = model->log_totals[shared];
+  if (model->ranks != NULL)
+    memcpy(model->ranks + row * width, model->ranks + shared * width,
+           width * sizeof(int32_t));
+
+  --model->row_refs[shared];
+  model->row_refs[row] = 1;
+  model->gram_rows[gram_i] = row;
+  ++model->n_rows;
+  return row;
+}
+
+typedef struct _ranked_state {
+  float probability;
+  int32_t state_i;
+} ranked_state;
+
+// Most likely first, then in column order
+static int by_probability(const void *a, const void *b) {
+  const ranked_state *x = (const ranked_state *)a;
+  const ranked_state *y = (const ranked_state *)b;
+  if (x->probability != y->probability)
+    return x->probability < y->probability ? 1 : -1;
+  return x->state_i - y->state_i;
+}
+
+static inline int ranks_before(const float *probabilities, int32_t a,
+                               int32_t b) {
+  return probabilities[a] > probabilities[b] ||
+         (probabilities[a] == probabilities[b] && a < b);
+}
+
+// Re-sorts a row's ranks in place, linear when an edit moved one state
+static void rerank_row(pm_model *model, int64_t row) {
+  int32_t *ranks = model->ranks + row * model->row_width;
+  const float *probabilities = model->probabilities[row];
+  for (int i = 1; i < model->n_states; ++i) {
+    const int32_t state_i = ranks[i];
+    int k = i;
+    for (; k > 0 && ranks_before(probabilities, state_i, ranks[k - 1]); --k)
+      ranks[k] = ranks[k - 1];
+    ranks[k] = state_i;
+  }
+}
+
+int pm_model_rank(pm_model *model) {
+  if (model->ranks != NULL) return 0;
+
+  const int width = model->row_width;
+  int32_t *ranks = (int32_t *)alloc_table(
+      &model->memory, model->row_capacity * width * sizeof(int32_t));
+  ranked_state *sorted =
+      (ranked_state *)malloc(model->n_states * sizeof(ranked_state));
+  if (ranks == NULL || sorted == NULL) {
+    free_table(ranks);
+    free(sorted);
+    return 1;
+  }
+
+  for (int64_t row = 0; row < model->n_rows; ++row) {
+    for (int j = 0; j < model->n_states; ++j)
+      sorted[j] = (ranked_state){model->probabilities[row][j], j};
+    qsort(sorted, model->n_states, sizeof(ranked_state), by_probability);
+    for (int j = 0; j < width; ++j)
+      ranks[row * width + j] = j < model->n_states ? sorted[j].state_i : j;
+  }
+
+  free(sorted);
+  model->ranks = ranks;
+  return 0;
+}
+
+static void update_log_total(pm_model *model, int64_t row) {
+  float total = row_total(model, row);
+  model->log_totals[row] = total > 0 ? logf(total) : -PM_LOG_ZERO;
+}
+
+static inline float log_probability(const pm_model *model, int64_t gram_i,
+                                    int state_i) {
+  if (gram_i == -1 || model->muted[state_i]) return PM_LOG_ZERO;
+  const int64_t row = model->gram_rows[gram_i];
+  float lp = model->log_weights[row * model->row_width + state_i] -
+             model->log_totals[row];
+  return lp > PM_LOG_ZERO ? lp : PM_LOG_ZERO;
+}
+
+float pm_log_probability(const pm_model *model, int64_t gram_i, int state_i) {
+  return log_probability(model, gram_i, state_i);
+}
+
+static pm_step_fn kernel(int width) {
+  return width == 4    ? step_4
+         : width == 8  ? step_8
+         : width == 16 ? step_16
+                       : step_generic;
+}
+
+static int is_packed(const pm_model *model, const float *row) {
+  return model->packed_rows != NULL && row >= model->packed_rows &&
+         row < model->packed_rows + model->n_packed * model->n_states;
+}
+
+// Moves the rows from a block each into one table
+static int pack_rows(pm_model *model) {
+  const size_t size = model->n_states * sizeof(float);
+  float *packed = (float *)alloc_table(&model->memory, model->n_rows * size);
+  if (packed == NULL) return 1;
+
+  for (int64_t row = 0; row < model->n_rows; ++row) {
+    float *probabilities = packed + row * model->n_states;
+    memcpy(probabilities, model->probabilities[row], size);
+    free(model->probabilities[row]);
+    model->probabilities[row] = probabilities;
+  }
+  model->packed_rows = packed;
+  model->n_packed = model->n_rows;
+  return 0;
+}
+
+// Picks the transition kernel for n_states and order, building its tables.
+// Returns 1 if they cannot be allocated.
+static int compile_kernel(pm_model *model) {
+  int width = 4;
+  while (width < model->n_states) width *= 2;
+  model->row_width = width;
+  if (pack_rows(model)) return 1;
+
+  model->row_capacity = model->n_rows;
+  model->muted = (char *)calloc(model->n_states, sizeof(char));
+  model->trees = alloc_floats(&model->memory, model->n_rows * width);
+  if (model->muted == NULL || model->trees == NULL) return 1;
+  for (int64_t row = 0; row < model->n_rows; ++row) build_row(model, row);
+
+  if (model->order * model->state_bits <= MAX_DENSE_KEY_BITS) {
+    uint64_t n_keys = model->gram_mask + 1;
+    model->gram_table =
+        (int64_t *)alloc_table(&model->memory, n_keys * sizeof(int64_t));
+    if (model->gram_table == NULL) return 1;
+    for (uint64_t key = 0; key < n_keys; ++key)
+      model->gram_table[key] = pm_map_get(&model->gram_map, key);
+  }
+
+  model->successors = (int64_t *)alloc_table(
+      &model->memory, model->n_grams * width * sizeof(int64_t));
+  model->log_weights = alloc_floats(&model->memory, model->n_rows * width);
+  model->log_totals = alloc_floats(&model->memory, model->n_rows);
+  if (model->successors == NULL || model->log_weights == NULL ||
+      model->log_totals == NULL)
+    return 1;
+
+  for (int64_t i = 0; i < model->n_grams; ++i)
+    for (int j = 0; j < width; ++j) {
+      uint64_t key = ((model->gram_keys[i] << model->state_bits) |
+                      (uint64_t)j) &
+                     model->gram_mask;
+      model->successors[i * width + j] =
+          j < model->n_states ? find_gram(model, key) : -1;
+    }
+
+  for (int64_t row = 0; row < model->n_rows; ++row) {
+    for (int j = 0; j < width; ++j) {
+      float p = j < model->n_states ? model->probabilities[row][j] : 0;
+      model->log_weights[row * width + j] = p > 0 ? logf(p) : PM_LOG_ZERO;
+    }
+    update_log_total(model, row);
+  }
+
+  model->step = kernel(width);
+  return 0;
+}
+
+void pm_model_link(pm_model *model) { model->step = kernel(model->row_width); }
+
+typedef struct _ranked_gram {
+  int64_t count;
+  int64_t gram_i;
+} ranked_gram;
+
+// Most visited first, then in CSV order
+static int by_count(const void *a, const void *b) {
+  const ranked_gram *x = (const ranked_gram *)a, *y = (const ranked_gram *)b;
+  if (x->count != y->count) return x->count < y->count ? 1 : -1;
+  return (x->gram_i > y->gram_i) - (x->gram_i < y->gram_i);
+}
+
+static uint64_t hash_name(uint64_t seed, const char *name) {
+  uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+  for (; *name != '\0'; ++name)
+    hash = (hash ^ (unsigned char)*name) * 0x100000001b3ULL;
+  return hash_key(hash);
+}
+
+// Minimal perfect hash of the gram names by hash and displace (CHD): names
+// are bucketed by one hash, then the largest buckets first search for a
+// seed sending all their names to free slots. A bucket of one takes a free
+// slot directly, stored as -1 - slot. Returns 1 if it cannot be built.
+static int build_name_hash(pm_model *x) {
+  const int64_t n = x->n_grams;
+  int64_t *buckets = (int64_t *)malloc(n * sizeof(int64_t));
+  int64_t *starts = (int64_t *)calloc(n + 1, sizeof(int64_t));
+  int64_t *members = (int64_t *)malloc(n * sizeof(int64_t));
+  int64_t *placed = (int64_t *)malloc(n * sizeof(int64_t));
+  ranked_gram *sizes = (ranked_gram *)malloc(n * sizeof(ranked_gram));
+  x->name_seeds = (int64_t *)calloc(n, sizeof(int64_t));
+  x->name_slots = (int64_t *)malloc(n * sizeof(int64_t));
+  int failed = buckets == NULL || starts == NULL || members == NULL ||
+               placed == NULL || sizes == NULL || x->name_seeds == NULL ||
+               x->name_slots == NULL;
+
+  if (!failed) {
+    for (int64_t i = 0; i < n; ++i) {
+      buckets[i] = hash_name(0, x->grams[i]) % n;
+      ++starts[buckets[i] + 1];
+      x->name_slots[i] = -1;
+    }
+    for (int64_t b = 0; b < n; ++b) {
+      sizes[b] = (ranked_gram){starts[b + 1], b};
+      starts[b + 1] += starts[b];
+    }
+    for (int64_t i = 0; i < n; ++i) members[starts[buckets[i]]++] = i;
+    for (int64_t b = n; b > 0; --b) starts[b] = starts[b - 1];
+    starts[0] = 0;
+    qsort(sizes, n, sizeof(ranked_gram), by_count);
+  }
+
+  int64_t next_free = 0;
+  for (int64_t k = 0; k < n && !failed && sizes[k].count > 0; ++k) {
+    const int64_t b = sizes[k].gram_i;
+    const int64_t *bucket = members + starts[b];
+    const int64_t size = sizes[k].count;
+    if (size == 1) {
+      while (x->name_slots[next_free] != -1) ++next_free;
+      x->name_slots[next_free] = bucket[0];
+      x->name_seeds[b] = -1 - next_free;
+      continue;
+    }
+
+    int64_t seed = 1, n_placed = 0;
+    for (; seed < MAX_NAME_SEED && n_placed < size; ++seed)
+      for (n_placed = 0; n_placed < size; ++n_placed) {
+        int64_t slot = hash_name(seed, x->grams[bucket[n_placed]]) % n;
+        int taken = x->name_slots[slot] != -1;
+        for (int64_t i = 0; i < n_placed && !taken; ++i)
+          taken = placed[i] == slot;
+        if (taken) break;
+        placed[n_placed] = slot;
+      }
+    failed = n_placed < size;
+    for (int64_t i = 0; i < size && !failed; ++i)
+      x->name_slots[placed[i]] = bucket[i];
+    x->name_seeds[b] = seed - 1;
+  }
+
+  free(buckets);
+  free(starts);
+  free(members);
+  free(placed);
+  free(sizes);
+  return failed;
+}
+
+int64_t pm_model_find_name(const pm_model *model, const char *name) {
+  const int64_t n = model->n_grams;
+  if (n == 0 || model->name_seeds == NULL) return -1;
+
+  const int64_t seed = model->name_seeds[hash_name(0, name) % n];
+  const int64_t slot =
+      seed < 0 ? -1 - seed : (int64_t)(hash_name(seed, name) % n);
+  const int64_t gram_i = model->name_slots[slot];
+  return strcmp(model->grams[gram_i], name) == 0 ? gram_i : -1;
+}
+
+void pm_model_free(pm_model *model) {
+  if (model == NULL || model->is_static) return;
+
+  if (model->states != NULL)
+    for (int i = 0; i < model->n_states; ++i) free(model->states[i]);
+  free(model->states);
+
+  if (model->grams != NULL)
+    for (int64_t i = 0; i < model->n_grams; ++i) free(model->grams[i]);
+  free(model->grams);
+  free(model->gram_keys);
+  free(model->gram_rows);
+  pm_map_free(&model->gram_map);
+  free(model->name_seeds);
+  free(model->name_slots);
+
+  if (model->probabilities != NULL)
+    for (int64_t row = 0; row < model->n_rows; ++row)
+      if (!is_packed(model, model->probabilities[row]))
+        free(model->probabilities[row]);
+  free(model->probabilities);
+  free_table(model->packed_rows);
+  free(model->row_refs);
+
+  free(model->muted);
+  free_table(model->trees);
+  free_table(model->gram_table);
+  free_table(model->successors);
+  free_table(model->log_weights);
+  free_table(model->log_totals);
+  free_table(model->ranks);
+  free(model->csv_path);
+  free(model);
+}
+
+static int64_t mtime_ns(const struct stat *file) {
+  return (int64_t)file->st_mtime * 1000000000 + MTIME_NSEC(file);
+}
+
+pm_model *pm_model_load_csv(const char *csv_path, int order, int n_states,
+                            const pm_memory *memory, pm_log_fn log,
+                            void *user) {
+  pm_model *model = (pm_model *)calloc(1, sizeof(pm_model));
+  if (model == NULL) {
+    report(log, user, "Error allocating memory for pm_model");
+    return NULL;
+  }
+  if (memory != NULL) model->memory = *memory;
+
+  model->csv_path = strdup(csv_path);
+  model->order = order;
+  model->n_states = n_states;
+
+  // Before parsing, so a write racing the parse shows up as a change later
+  struct stat file;
+  if (stat(csv_path, &file) == 0) {
+    model->csv_size = file.st_size;
+    model->csv_mtime_ns = mtime_ns(&file);
+  }
+
+  if (csv_to_pm(model, csv_path, log, user)) {
+    report(log, user, "Error loading %s", csv_path);
+    pm_model_free(model);
+    return NULL;
+  }
+  if (dedup_rows(model) || compile_kernel(model) || build_name_hash(model)) {
+    report(log, user, "Error allocating memory for transition kernel");
+    pm_model_free(model);
+    return NULL;
+  }
+
+  return model;
+}
+
+int pm_model_csv_changed(const pm_model *model) {
+  struct stat file;
+  return stat(model->csv_path, &file) != 0 ||
+         file.st_size != model->csv_size ||
+         mtime_ns(&file) != model->csv_mtime_ns;
+}
+
+static void *copy(const void *source, size_t size) {
+  void *copied = malloc(size);
+  if (copied != NULL) memcpy(copied, source, size);
+  return copied;
+}
+
+static void *copy_table(const pm_memory *memory, const void *source,
+                        size_t size) {
+  void *copied = alloc_table(memory, size);
+  if (copied != NULL) memcpy(copied, source, size);
+  return copied;
+}
+
+pm_model *pm_model_clone(const pm_model *model) {
+  return pm_model_place(model, &model->memory);
+}
+
+pm_model *pm_model_place(const pm_model *model, const pm_memory *memory) {
+  pm_model *x = (pm_model *)calloc(1, sizeof(pm_model));
+  if (x == NULL) return NULL;
+
+  const int width = model->row_width;
+  const uint64_t capacity = model->gram_map.mask + 1;
+  *x = (pm_model){
+      .memory = *memory,
+      .order = model->order,
+      .n_states = model->n_states,
+      .n_grams = model->n_grams,
+      .state_bits = model->state_bits,
+      .gram_mask = model->gram_mask,
+      .gram_map = {NULL, NULL, model->gram_map.mask, model->gram_map.size},
+      .n_rows = model->n_rows,
+      .row_capacity = model->n_rows,
+      .step = model->step,
+      .row_width = width,
+      .revision = model->revision,
+  };
+
+  x->csv_path = strdup(model->csv_path);
+  x->states = (char **)calloc(model->n_states, sizeof(char *));
+  x->grams = (char **)calloc(model->n_grams, sizeof(char *));
+  x->probabilities = (float **)calloc(model->n_grams, sizeof(float *));
+  int failed = x->csv_path == NULL || x->states == NULL || x->grams == NULL ||
+               x->probabilities == NULL;
+
+  for (int i = 0; i < model->n_states && !failed; ++i)
+    failed = (x->states[i] = strdup(model->states[i])) == NULL;
+  for (int64_t i = 0; i < model->n_grams && !failed; ++i)
+    failed = (x->grams[i] = strdup(model->grams[i])) == NULL;
+  x->packed_rows = (float *)alloc_table(
+      memory, model->n_rows * model->n_states * sizeof(float));
+  failed = failed || x->packed_rows == NULL;
+  if (!failed) {
+    x->n_packed = model->n_rows;
+    for (int64_t row = 0; row < model->n_rows; ++row) {
+      x->probabilities[row] = x->packed_rows + row * model->n_states;
+      memcpy(x->probabilities[row], model->probabilities[row],
+             model->n_states * sizeof(float));
+    }
+  }
+
+  x->gram_keys = (uint64_t *)copy(model->gram_keys,
+                                  model->n_grams * sizeof(uint64_t));
+  x->gram_rows =
+      (int64_t *)copy(model->gram_rows, model->n_grams * sizeof(int64_t));
+  if (model->name_seeds != NULL) {
+    x->name_seeds =
+        (int64_t *)copy(model->name_seeds, model->n_grams * sizeof(int64_t));
+    x->name_slots =
+        (int64_t *)copy(model->name_slots, model->n_grams * sizeof(int64_t));
+  }
+  x->row_refs = (int64_t *)calloc(model->n_grams, sizeof(int64_t));
+  if (x->row_refs != NULL)
+    memcpy(x->row_refs, model->row_refs, model->n_rows * sizeof(int64_t));
+  x->gram_map.keys =
+      (uint64_t *)copy(model->gram_map.keys, capacity * sizeof(uint64_t));
+  x->gram_map.values =
+      (int64_t *)copy(model->gram_map.values, capacity * sizeof(int64_t));
+  x->muted = (char *)copy(model->muted, model->n_states);
+  x->trees = (float *)copy_table(memory, model->trees,
+                                 model->n_rows * width * sizeof(float));
+  if (model->gram_table != NULL)
+    x->gram_table = (int64_t *)copy_table(
+        memory, model->gram_table, (model->gram_mask + 1) * sizeof(int64_t));
+  x->successors = (int64_t *)copy_table(
+      memory, model->successors, model->n_grams * width * sizeof(int64_t));
+  x->log_weights = (float *)copy_table(memory, model->log_weights,
+                                       model->n_rows * width * sizeof(float));
+  x->log_totals = (float *)copy_table(memory, model->log_totals,
+                                      model->n_rows * sizeof(float));
+  if (model->ranks != NULL)
+    x->ranks = (int32_t *)copy_table(
+        memory, model->ranks, model->n_rows * width * sizeof(int32_t));
+
+  if (failed || x->gram_keys == NULL || x->gram_rows == NULL ||
+      (model->name_seeds != NULL &&
+       (x->name_seeds == NULL || x->name_slots == NULL)) ||
+      x->row_refs == NULL || x->gram_map.keys == NULL ||
+      x->gram_map.values == NULL || x->muted == NULL || x->trees == NULL ||
+      (model->gram_table != NULL && x->gram_table == NULL) ||
+      x->successors == NULL || x->log_weights == NULL ||
+      x->log_totals == NULL || (model->ranks != NULL && x->ranks == NULL)) {
+    pm_model_free(x);
+    return NULL;
+  }
+
+  return x;
+}
+
+int pm_model_set(pm_model *model, int64_t gram_i, int state_i,
+                 float probability) {
+  int64_t row = model->gram_rows[gram_i];
+  if (model->row_refs[row] > 1 && (row = split_row(model, gram_i)) == -1)
+    return 1;
+
+  float delta = probability - model->probabilities[row][state_i];
+  model->probabilities[row][state_i] = probability;
+  model->log_weights[row * model->row_width + state_i] =
+      probability > 0 ? logf(probability) : PM_LOG_ZERO;
+  ++model->revision;
+  if (model->ranks != NULL) rerank_row(model, row);
+  if (!model->muted[state_i])
+    fenwick_add(model->trees + row * model->row_width, model->row_width,
+                state_i, delta);
+  update_log_total(model, row);
+  return 0;
+}
+
+void pm_model_mute(pm_model *model, int state_i, int muted) {
+  if (model->muted[state_i] == (muted != 0)) return;
+
+  model->muted[state_i] = muted != 0;
+  ++model->revision;
+  for (int64_t row = 0; row < model->n_rows; ++row) {
+    float delta = model->probabilities[row][state_i];
+    fenwick_add(model->trees + row * model->row_width, model->row_width,
+                state_i, muted ? -delta : delta);
+    update_log_total(model, row);
+  }
+}
+
+int64_t pm_model_update(pm_model *model, const pm_model *source) {
+  if (source->order != model->order || source->n_states != model->n_states ||
+      source->n_grams != model->n_grams)
+    return -1;
+  for (int j = 0; j < model->n_states; ++j)
+    if (strcmp(source->states[j], model->states[j]) != 0) return -1;
+  for (int64_t i = 0; i < source->n_grams; ++i)
+    if (find_gram(model, source->gram_keys[i]) == -1) return -1;
+
+  const int width = model->row_width;
+  const size_t size = model->n_states * sizeof(float);
+  int64_t n_changed = 0;
+  for (int64_t i = 0; i < source->n_grams; ++i) {
+    const float *probabilities = source->probabilities[source->gram_rows[i]];
+    const int64_t gram_i = find_gram(model, source->gram_keys[i]);
+    int64_t row = model->gram_rows[gram_i];
+    if (memcmp(model->probabilities[row], probabilities, size) == 0) continue;
+    if (model->row_refs[row] > 1 && (row = split_row(model, gram_i)) == -1)
+      return -1;
+
+    memcpy(model->probabilities[row], probabilities, size);
+    for (int j = 0; j < model->n_states; ++j)
+      model->log_weights[row * width + j] =
+          probabilities[j] > 0 ? logf(probabilities[j]) : PM_LOG_ZERO;
+    build_row(model, row);
+    update_log_total(model, row);
+    if (model->ranks != NULL) rerank_row(model, row);
+    ++n_changed;
+  }
+  if (n_changed > 0) ++model->revision;
+  return n_changed;
+}
+
+int64_t *pm_model_visit_order(const pm_model *model, const int64_t *visits,
+                              int64_t n_visits) {
+  const int64_t n = model->n_grams;
+  ranked_gram *ranked = (ranked_gram *)calloc(n, sizeof(ranked_gram));
+  int64_t *next = (int64_t *)malloc(n * sizeof(int64_t));
+  int64_t *next_count = (int64_t *)calloc(n, sizeof(int64_t));
+  int64_t *where = (int64_t *)malloc(n * sizeof(int64_t));
+  pm_map pairs = {0};  // from * n_grams + to -> times followed
+  int failed = ranked == NULL || next == NULL || next_count == NULL ||
+               where == NULL || pm_map_init(&pairs, 16);
+
+  for (int64_t g = 0; g < n && !failed; ++g) {
+    ranked[g].gram_i = g;
+    next[g] = -1;
+    where[g] = -1;
+  }
+
+  for (int64_t k = 0; k < n_visits && !failed; ++k) {
+    const int64_t from = visits[k];
+    if (from < 0 || from >= n) continue;
+    ++ranked[from].count;
+
+    const int64_t to = k + 1 < n_visits ? visits[k + 1] : -1;
+    if (to < 0 || to >= n) continue;
+    const uint64_t pair = (uint64_t)from * n + to;
+    int64_t count = pm_map_get(&pairs, pair);
+    count = count == -1 ? 1 : count + 1;
+    failed = pm_map_put(&pairs, pair, count);
+    if (count > next_count[from]) {
+      next_count[from] = count;
+      next[from] = to;
+    }
+  }
+
+  if (!failed) {
+    // Chains each gram to its most frequent successor, hottest first
+    qsort(ranked, n, sizeof(ranked_gram), by_count);
+    int64_t placed = 0;
+    for (int64_t i = 0; i < n; ++i)
+      for (int64_t g = ranked[i].gram_i; g != -1 && where[g] == -1;
+           g = next[g])
+        where[g] = placed++;
+  }
+
+  free(ranked);
+  free(next);
+  free(next_count);
+  pm_map_free(&pairs);
+  if (failed) {
+    free(where);
+    return NULL;
+  }
+  return where;
+}
+
+int pm_model_reorder(pm_model *model, const int64_t *where) {
+  const int64_t n = model->n_grams;
+  const int width = model->row_width;
+  int64_t *order = (int64_t *)malloc(n * sizeof(int64_t));
+  int64_t *row_where = (int64_t *)malloc(model->n_rows * sizeof(int64_t));
+  char **grams = (char **)malloc(n * sizeof(char *));
+  uint64_t *gram_keys = (uint64_t *)malloc(n * sizeof(uint64_t));
+  int64_t *gram_rows = (int64_t *)malloc(n * sizeof(int64_t));
+  const pm_memory *memory = &model->memory;
+  int64_t *successors =
+      (int64_t *)alloc_table(memory, n * width * sizeof(int64_t));
+  float **probabilities = (float **)calloc(n, sizeof(float *));
+  int64_t *row_refs = (int64_t *)malloc(n * sizeof(int64_t));
+  float *trees = alloc_floats(memory, model->row_capacity * width);
+  float *log_weights = alloc_floats(memory, model->row_capacity * width);
+  float *log_totals = alloc_floats(memory, model->row_capacity);
+  int32_t *ranks =
+      model->ranks != NULL
+          ? (int32_t *)alloc_table(
+                memory, model->row_capacity * width * sizeof(int32_t))
+          : NULL;
+  const size_t row_size = model->n_states * sizeof(float);
+  float *packed = (float *)alloc_table(memory, model->n_rows * row_size);
+  if ((model->ranks != NULL && ranks == NULL) || packed == NULL ||
+      order == NULL ||
+      row_where == NULL || grams == NULL || gram_keys == NULL ||
+      gram_rows == NULL || successors == NULL || probabilities == NULL ||
+      row_refs == NULL || trees == NULL || log_weights == NULL ||
+      log_totals == NULL) {
+    free(order);
+    free(row_where);
+    free(grams);
+    free(gram_keys);
+    free(gram_rows);
+    free_table(successors);
+    free(probabilities);
+    free(row_refs);
+    free_table(trees);
+    free_table(log_weights);
+    free_table(log_totals);
+    free_table(ranks);
+    free_table(packed);
+    return 1;
+  }
+
+  for (int64_t i = 0; i < n; ++i) order[where[i]] = i;
+  for (int64_t row = 0; row < model->n_rows; ++row) row_where[row] = -1;
+
+  // Rows follow the first gram to use them, in memory too, since sampling
+  // reads the probabilities alongside the trees
+  int64_t n_rows = 0;
+  for (int64_t i = 0; i < n; ++i) {
+    const int64_t old = order[i];
+    const int64_t row = model->gram_rows[old];
+    if (row_where[row] == -1) {
+      row_where[row] = n_rows;
+      probabilities[n_rows] = packed + n_rows * model->n_states;
+      memcpy(probabilities[n_rows], model->probabilities[row], row_size);
+      row_refs[n_rows] = model->row_refs[row];
+      memcpy(trees + n_rows * width, model->trees + row * width,
+             width * sizeof(float));
+      memcpy(log_weights + n_rows * width, model->log_weights + row * width,
+             width * sizeof(float));
+      log_totals[n_rows] = model->log_totals[row];
+      if (ranks != NULL)
+        memcpy(ranks + n_rows * width, model->ranks + row * width,
+               width * sizeof(int32_t));
+      ++n_rows;
+    }
+
+    grams[i] = model->grams[old];
+    gram_keys[i] = model->gram_keys[old];
+    gram_rows[i] = row_where[row];
+    for (int j = 0; j < width; ++j) {
+      const int64_t successor = model->successors[old * width + j];
+      successors[i * width + j] = successor == -1 ? -1 : where[successor];
+    }
+  }
+
+  if (model->name_slots != NULL)
+    for (int64_t slot = 0; slot < n; ++slot)
+      model->name_slots[slot] = where[model->name_slots[slot]];
+  for (uint64_t i = 0; i <= model->gram_map.mask; ++i)
+    if (model->gram_map.values[i] != -1)
+      model->gram_map.values[i] = where[model->gram_map.values[i]];
+  if (model->gram_table != NULL)
+    for (uint64_t key = 0; key <= model->gram_mask; ++key)
+      if (model->gram_table[key] != -1)
+        model->gram_table[key] = where[model->gram_table[key]];
+
+  for (int64_t row = 0; row < model->n_rows; ++row)
+    if (!is_packed(model, model->probabilities[row]))
+      free(model->probabilities[row]);
+  free_table(model->packed_rows);
+  model->packed_rows = packed;
+  model->n_packed = model->n_rows;
+
+  free(model->grams);
+  free(model->gram_keys);
+  free(model->gram_rows);
+  free_table(model->successors);
+  free(model->probabilities);
+  free(model->row_refs);
+  free_table(model->trees);
+  free_table(model->log_weights);
+  free_table(model->log_totals);
+  free_table(model->ranks);
+  model->grams = grams;
+  model->gram_keys = gram_keys;
+  model->gram_rows = gram_rows;
+  model->successors = successors;
+  model->probabilities = probabilities;
+  model->row_refs = row_refs;
+  model->trees = trees;
+  model->log_weights = log_weights;
+  model->log_totals = log_totals;
+  model->ranks = ranks;
+  ++model->revision;
+
+  free(order);
+  free(row_where);
+  return 0;
+}
+
+int pm_model_write_csv(const pm_model *model, const char *csv_path,
+                       pm_log_fn log, void *user) {
+  FILE *file = fopen(csv_path, "w");
+  if (file == NULL) {
+    report(log, user, "Error opening file %s. %s", csv_path, strerror(errno));
+    return 1;
+  }
+
+  fprintf(file, "gram");
+  for (int j = 0; j < model->n_states; ++j)
+    fprintf(file, ",%s", model->states[j]);
+  fputc('\n', file);
+
+  for (int64_t i = 0; i < model->n_grams; ++i) {
+    const float *row = model->probabilities[model->gram_rows[i]];
+    fprintf(file, "%s", model->grams[i]);
+    for (int j = 0; j < model->n_states; ++j) fprintf(file, ",%.9g", row[j]);
+    fputc('\n', file);
+  }
+
+  int failed = ferror(file);
+  if (fclose(file) != 0 || failed) {
+    report(log, user, "Error writing file %s. %s", csv_path, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+void pm_cursor_init(pm_cursor *cursor, const pm_model *model,
+                    const pm_model *target, uint64_t seed) {
+  cursor->key = model->gram_keys[0];
+  cursor->gram_i = 0;
+  cursor->morph_threshold = 0;
+  cursor->rng.state = seed;
+  cursor->draw = 0;
+  pm_cursor_set_shape(cursor, 1, 0);
+  pm_cursor_set_target(cursor, target);
+}
+
+void pm_cursor_set_key(pm_cursor *cursor, const pm_model *model,
+                       const pm_model *target, uint64_t key) {
+  cursor->key = key & model->gram_mask;
+  cursor->gram_i = find_gram(model, cursor->key);
+  pm_cursor_set_target(cursor, target);
+}
+
+void pm_cursor_settle(pm_cursor *cursor, const pm_model *model,
+                      const pm_model *target) {
+  if (cursor->gram_i != -1 || cursor->target_gram_i != -1) return;
+
+  const uint64_t state_mask = ((uint64_t)1 << model->state_bits) - 1;
+  int64_t best_i = 0;
+  int best_length = -1;
+  for (int64_t i = 0; i < model->n_grams; ++i) {
+    const uint64_t diff = model->gram_keys[i] ^ cursor->key;
+    int length = 0;
+    while (length < model->order &&
+           !((diff >> (length * model->state_bits)) & state_mask))
+      ++length;
+    if (length > best_length) {
+      best_i = i;
+      best_length = length;
+    }
+  }
+  pm_cursor_set_key(cursor, model, target, model->gram_keys[best_i]);
+}
+
+void pm_cursor_set_target(pm_cursor *cursor, const pm_model *target) {
+  cursor->target_gram_i = target != NULL ? find_gram(target, cursor->key) : -1;
+}
+
+void pm_cursor_set_morph(pm_cursor *cursor, float morph) {
+  morph = morph < 0 ? 0 : morph > 1 ? 1 : morph;
+  cursor->morph_threshold = (uint64_t)(morph * 4294967296.0);
+}
+
+void pm_cursor_set_shape(pm_cursor *cursor, float temperature, int top_k) {
+  cursor->top_k = top_k > 0 ? top_k : 0;
+  cursor->inv_temperature = 1;
+  if (!(temperature > 0))
+    cursor->top_k = 1;  // Greedy
+  else
+    cursor->inv_temperature = 1 / temperature;
+  cursor->shaped = cursor->top_k > 0 || cursor->inv_temperature != 1;
+}
+
+// Builds empty rows for the order suffixes of model's grams, order < k
+static pm_model *marginal(const pm_model *model, int order) {
+  pm_model *x = (pm_model *)calloc(1, sizeof(pm_model));
+  if (x == NULL) return NULL;
+
+  x->memory = model->memory;
+  x->order = order;
+  x->n_states = model->n_states;
+  x->state_bits = model->state_bits;
+  x->gram_mask = (1ULL << (order * model->state_bits)) - 1;
+  x->gram_keys = (uint64_t *)malloc(model->n_grams * sizeof(uint64_t));
+  x->gram_rows = (int64_t *)malloc(model->n_grams * sizeof(int64_t));
+  x->probabilities = (float **)calloc(model->n_grams, sizeof(float *));
+  x->row_refs = (int64_t *)malloc(model->n_grams * sizeof(int64_t));
+  if (x->gram_keys == NULL || x->gram_rows == NULL ||
+      x->probabilities == NULL || x->row_refs == NULL ||
+      pm_map_init(&x->gram_map, 16)) {
+    pm_model_free(x);
+    return NULL;
+  }
+
+  for (int64_t i = 0; i < model->n_grams; ++i) {
+    uint64_t key = model->gram_keys[i] & x->gram_mask;
+    if (pm_map_get(&x->gram_map, key) != -1) continue;
+
+    int64_t gram_i = x->n_grams++;
+    x->n_rows = x->n_grams;  // Filled later, so never deduplicated
+    x->gram_keys[gram_i] = key;
+    x->gram_rows[gram_i] = gram_i;
+    x->row_refs[gram_i] = 1;
+    x->probabilities[gram_i] = (float *)calloc(x->n_states, sizeof(float));
+    if (x->probabilities[gram_i] == NULL ||
+        pm_map_put(&x->gram_map, key, gram_i)) {
+      pm_model_free(x);
+      return NULL;
+    }
+  }
+
+  if (compile_kernel(x)) {
+    pm_model_free(x);
+    return NULL;
+  }
+  return x;
+}
+
+// Sums the normalized unmuted rows of model into their suffixes' rows
+static void fill_marginal(pm_model *x, const pm_model *model) {
+  for (int64_t row = 0; row < x->n_rows; ++row)
+    memset(x->probabilities[row], 0, x->n_states * sizeof(float));
+
+  for (int64_t i = 0; i < model->n_grams; ++i) {
+    const int64_t row = model->gram_rows[i];
+    float total = row_total(model, row);
+    if (!(total > 0)) continue;
+
+    float *sums = x->probabilities[x->gram_rows[find_gram(
+        x, model->gram_keys[i] & x->gram_mask)]];
+    for (int j = 0; j < model->n_states; ++j)
+      sums[j] += weight(model, row, j) / total;
+  }
+
+  for (int64_t row = 0; row < x->n_rows; ++row) {
+    build_row(x, row);
+    for (int j = 0; j < x->n_states; ++j) {
+      float p = x->probabilities[row][j];
+      x->log_weights[row * x->row_width + j] = p > 0 ? logf(p) : PM_LOG_ZERO;
+    }
+    update_log_total(x, row);
+    if (x->ranks != NULL) rerank_row(x, row);
+  }
+}
+
+// Witten-Bell weights. A row of the model itself counts as one gram.
+static void fill_lambdas(float *lambdas, const pm_model *x, float smooth,
+                         int is_model) {
+  for (int64_t g = 0; g < x->n_grams; ++g) {
+    const int64_t row = x->gram_rows[g];
+    float total = row_total(x, row);
+    float n = is_model ? (total > 0) : total;
+    int distinct = 0;
+    for (int j = 0; j < x->n_states; ++j) distinct += weight(x, row, j) > 0;
+    lambdas[g] = n > 0 ? n / (n + smooth * distinct) : 0;
+  }
+}
+
+void pm_smoother_free(pm_smoother *smoother) {
+  if (smoother == NULL) return;
+
+  if (smoother->marginals != NULL)
+    for (int m = 0; m < smoother->order; ++m)
+      pm_model_free(smoother->marginals[m]);
+  free(smoother->marginals);
+  if (smoother->lambdas != NULL)
+    for (int m = 0; m <= smoother->order; ++m)
+      free_table(smoother->lambdas[m]);
+  free(smoother->lambdas);
+  free(smoother);
+}
+
+pm_smoother *pm_smoother_new(const pm_model *model, float smooth) {
+  pm_smoother *smoother = (pm_smoother *)calloc(1, sizeof(pm_smoother));
+  if (smoother == NULL) return NULL;
+
+  smoother->order = model->order;
+  smoother->smooth = smooth;
+  smoother->marginals =
+      (pm_model **)calloc(model->order, sizeof(pm_model *));
+  smoother->lambdas = (float **)calloc(model->order + 1, sizeof(float *));
+  int failed = smoother->marginals == NULL || smoother->lambdas == NULL;
+
+  for (int m = 0; m <= model->order && !failed; ++m) {
+    if (m < model->order)
+      failed = (smoother->marginals[m] = marginal(model, m)) == NULL;
+    if (!failed) {
+      int64_t n_grams = m < model->order ? smoother->marginals[m]->n_grams
+                                         : model->n_grams;
+      failed = (smoother->lambdas[m] =
+                    alloc_floats(&model->memory, n_grams)) == NULL;
+    }
+  }
+  if (failed) {
+    pm_smoother_free(smoother);
+    return NULL;
+  }
+
+  pm_smoother_update(smoother, model);
+  for (int m = 0; m < model->order && model->ranks != NULL; ++m)
+    if (pm_model_rank(smoother->marginals[m])) {
+      pm_smoother_free(smoother);
+      return NULL;
+    }
+  return smoother;
+}
+
+void pm_smoother_update(pm_smoother *smoother, const pm_model *model) {
+  for (int m = 0; m < smoother->order; ++m) {
+    fill_marginal(smoother->marginals[m], model);
+    fill_lambdas(smoother->lambdas[m], smoother->marginals[m],
+                 smoother->smooth, 0);
+  }
+  fill_lambdas(smoother->lambdas[smoother->order], model, smoother->smooth, 1);
+  smoother->revision = model->revision;
+}
+
+// First stage picks an order from its weight given u in [0, 1), backing off
+// past unlisted suffixes, then the second samples that order's row with r
+static int sample_smoothed(const pm_model *model, const pm_smoother *smoother,
+                           const pm_cursor *cursor, float u, float r) {
+  const uint64_t key = cursor->key;
+  const int64_t gram_i = cursor->gram_i;
+  for (int m = smoother->order; m >= 0; --m) {
+    const pm_model *rows = m == smoother->order ? model
+                                                : smoother->marginals[m];
+    int64_t g = m == smoother->order ? gram_i
+                                     : find_gram(rows, key & rows->gram_mask);
+    if (g == -1) continue;
+
+    const float lambda = m == 0 ? 1 : smoother->lambdas[m][g];
+    if (u < lambda)
+      return draw_row(rows, rows->gram_rows[g], model->row_width, cursor, r);
+    u = (u - lambda) / (1 - lambda);
+  }
+  return -1;
+}
+
+int pm_smooth_step(const pm_model *model, const pm_model *target,
+                   const pm_smoother *smoother, pm_cursor *cursor) {
+  const uint64_t bits = pm_rng_next(&cursor->rng);
+  const uint64_t order_bits = pm_rng_next(&cursor->rng);
+  const float r = ((bits >> 40) & 0xffffff) * 0x1p-24f;
+  cursor->draw = bits >> 32;
+
+  const int64_t target_row =
+      target != NULL ? gram_row(target, cursor->target_gram_i) : -1;
+  int next_state_i;
+  if ((bits & 0xffffffff) < cursor->morph_threshold &&
+      row_total(target, target_row) > 0)
+    next_state_i = draw_row(target, target_row, target->row_width, cursor, r);
+  else
+    next_state_i = sample_smoothed(model, smoother, cursor,
+                                   (order_bits >> 40) * 0x1p-24f, r);
+  if (next_state_i == -1) return -1;
+
+  cursor->key = ((cursor->key << model->state_bits) | (uint64_t)next_state_i) &
+                model->gram_mask;
+  cursor->gram_i = find_gram(model, cursor->key);
+  cursor->target_gram_i = target != NULL ? find_gram(target, cursor->key) : -1;
+  return next_state_i;
+}
+
+float pm_score(const pm_model *model, pm_scorer *scorer, int state_i) {
+  if (state_i == -1) {
+    scorer->key = 0;
+    scorer->gram_i = -1;
+    scorer->n_read = 0;
+    return PM_LOG_ZERO;
+  }
+
+  float lp = 0;
+  int64_t next_gram_i = -1;
+  uint64_t key = ((scorer->key << model->state_bits) | (uint64_t)state_i) &
+                 model->gram_mask;
+
+  if (scorer->n_read < model->order) {
+    if (++scorer->n_read == model->order) next_gram_i = find_gram(model, key);
+  } else {
+    lp = log_probability(model, scorer->gram_i, state_i);
+    next_gram_i = scorer->gram_i != -1
+                      ? model->successors[scorer->gram_i * model->row_width +
+                                          state_i]
+                      : find_gram(model, key);
+    // Sampling stays on the gram when the next one is unlisted
+    if (next_gram_i == -1 && scorer->gram_i != -1) return lp;
+  }
+
+  scorer->key = key;
+  scorer->gram_i = next_gram_i;
+  return lp;
+}
+
+void pm_hmm_free(pm_hmm *hmm) {
+  if (hmm == NULL) return;
+
+  if (hmm->symbols != NULL)
+    for (int k = 0; k < hmm->n_symbols; ++k) free(hmm->symbols[k]);
+  free(hmm->symbols);
+  free_table(hmm->log_emissions);
+  free_table(hmm->log_transitions);
+  free(hmm->group_starts);
+  free(hmm->group_grams);
+  free(hmm->group_successors);
+  free_table(hmm->acc);
+  free(hmm->arg);
+  free_table(hmm->delta);
+  free_table(hmm->next_delta);
+  free(hmm->backpointers);
+  free(hmm->entered);
+  free(hmm);
+}
+
+// Copies the model's log probabilities, padded with PM_LOG_ZERO
+static void build_log_transitions(const pm_model *model, pm_hmm *hmm) {
+  const int width = model->row_width;
+  for (int64_t i = 0; i < model->n_grams; ++i)
+    for (int j = 0; j < width; ++j)
+      hmm->log_transitions[i * width + j] =
+          j < model->n_states ? log_probability(model, i, j) : PM_LOG_ZERO;
+  hmm->revision = model->revision;
+}
+
+static int group_grams(const pm_model *model, pm_hmm *hmm) {
+  const int width = model->row_width;
+  const uint64_t suffix_mask = model->gram_mask >> model->state_bits;
+
+  pm_map groups = {0};
+  int64_t *gram_groups = (int64_t *)malloc(model->n_grams * sizeof(int64_t));
+  uint64_t *group_keys = (uint64_t *)malloc(model->n_grams * sizeof(uint64_t));
+  if (gram_groups == NULL || group_keys == NULL ||
+      pm_map_init(&groups, 16)) {
+    free(gram_groups);
+    free(group_keys);
+    pm_map_free(&groups);
+    return 1;
+  }
+
+  int failed = 0;
+  for (int64_t i = 0; i < model->n_grams && !failed; ++i) {
+    uint64_t suffix = model->gram_keys[i] & suffix_mask;
+    int64_t group = pm_map_get(&groups, suffix);
+    if (group == -1) {
+      group = hmm->n_groups++;
+      group_keys[group] = suffix;
+      failed = pm_map_put(&groups, suffix, group);
+    }
+    gram_groups[i] = group;
+  }
+  pm_map_free(&groups);
+
+  if (!failed) {
+    hmm->group_starts =
+        (int64_t *)calloc(hmm->n_groups + 1, sizeof(int64_t));
+    hmm->group_grams = (int64_t *)malloc(model->n_grams * sizeof(int64_t));
+    hmm->group_successors =
+        (int64_t *)malloc(hmm->n_groups * width * sizeof(int64_t));
+  }
+  if (failed || hmm->group_starts == NULL || hmm->group_grams == NULL ||
+      hmm->group_successors == NULL) {
+    free(gram_groups);
+    free(group_keys);
+    return 1;
+  }
+
+  // Counting sort of the grams by group
+  for (int64_t i = 0; i < model->n_grams; ++i)
+    ++hmm->group_starts[gram_groups[i] + 1];
+  for (int64_t g = 0; g < hmm->n_groups; ++g)
+    hmm->group_starts[g + 1] += hmm->group_starts[g];
+  int64_t *ends = hmm->group_successors;  // Scratch until filled below
+  for (int64_t g = 0; g < hmm->n_groups; ++g)
+    ends[g] = hmm->group_starts[g];
+  for (int64_t i = 0; i < model->n_grams; ++i)
+    hmm->group_grams[ends[gram_groups[i]]++] = i;
+
+  for (int64_t g = 0; g < hmm->n_groups; ++g)
+    for (int j = 0; j < width; ++j) {
+      uint64_t key = ((group_keys[g] << model->state_bits) | (uint64_t)j) &
+                     model->gram_mask;
+      hmm->group_successors[g * width + j] =
+          j < model->n_states ? find_gram(model, key) : -1;
+    }
+
+  free(gram_groups);
+  free(group_keys);
+  return 0;
+}
+
+pm_hmm *pm_hmm_load_csv(const pm_model *model, const char *csv_path,
+                        int latency, pm_log_fn log, void *user) {
+  FILE *file = fopen(csv_path, "r");
+  if (file == NULL) {
+    report(log, user, "Error opening file %s. %s", csv_path, strerror(errno));
+    return NULL;
+  }
+
+  const int width = model->row_width;
+  pm_hmm *hmm = (pm_hmm *)calloc(1, sizeof(pm_hmm));
+  if (hmm == NULL) {
+    fclose(file);
+    return NULL;
+  }
+  hmm->latency = latency;
+
+  char line[MAX_LINE_SIZE];
+  float *emissions = NULL;  // (state, symbol)
+  int line_i = 0;
+  int failed = 0;
+
+  while (!failed && fgets(line, sizeof(line), file)) {
+    char *save;
+    char *token = strtok_r(line, DELIMITERS, &save);
+    int col_i = 0;
+    int state_i = -1;
+
+    if (line_i == 0) {  // Symbols
+      int capacity = 16;
+      hmm->symbols = (char **)malloc(capacity * sizeof(char *));
+      failed = hmm->symbols == NULL;
+      for (token = strtok_r(NULL, DELIMITERS, &save);
+           token != NULL && !failed;
+           token = strtok_r(NULL, DELIMITERS, &save)) {
+        if (hmm->n_symbols == capacity) {
+          capacity *= 2;
+          char **symbols =
+              (char **)realloc(hmm->symbols, capacity * sizeof(char *));
+          failed = symbols == NULL;
+          if (failed) break;
+          hmm->symbols = symbols;
+        }
+        hmm->symbols[hmm->n_symbols] = strdup(token);
+        failed = hmm->symbols[hmm->n_symbols++] == NULL;
+      }
+
+      emissions = (float *)calloc(model->n_states * (int64_t)hmm->n_symbols,
+                                  sizeof(float));
+      if (hmm->n_symbols == 0 || emissions == NULL) failed = 1;
+      ++line_i;
+      continue;
+    }
+
+    for (; token != NULL && col_i <= hmm->n_symbols;
+         token = strtok_r(NULL, DELIMITERS, &save), ++col_i) {
+      if (col_i == 0) {
+        state_i = pm_model_find_state(model, token);
+        if (state_i == -1) {
+          report(log, user, "[markov ] skipping emissions of unknown state %s",
+                 token);
+          break;
+        }
+      } else {
+        emissions[state_i * hmm->n_symbols + col_i - 1] = atof(token);
+      }
+    }
+    ++line_i;
+  }
+  fclose(file);
+
+  const pm_memory *memory = &model->memory;
+  hmm->log_emissions = alloc_floats(memory, hmm->n_symbols * (int64_t)width);
+  hmm->log_transitions = alloc_floats(memory, model->n_grams * width);
+  hmm->acc = alloc_floats(memory, width);
+  hmm->arg = (int *)malloc(width * sizeof(int));
+  hmm->delta = alloc_floats(memory, model->n_grams);
+  hmm->next_delta = alloc_floats(memory, model->n_grams);
+  hmm->backpointers =
+      (int64_t *)malloc(latency * model->n_grams * sizeof(int64_t));
+  hmm->entered = (int *)malloc(latency * model->n_grams * sizeof(int));
+  if (failed || hmm->log_emissions == NULL || hmm->log_transitions == NULL ||
+      hmm->acc == NULL || hmm->arg == NULL || hmm->delta == NULL ||
+      hmm->next_delta == NULL || hmm->backpointers == NULL ||
+      hmm->entered == NULL || group_grams(model, hmm)) {
+    report(log, user, "Error loading emissions from %s", csv_path);
+    free(emissions);
+    pm_hmm_free(hmm);
+    return NULL;
+  }
+
+  for (int j = 0; j < width; ++j) {
+    float total = 0;
+    if (j < model->n_states)
+      for (int k = 0; k < hmm->n_symbols; ++k)
+        total += emissions[j * hmm->n_symbols + k];
+
+    for (int k = 0; k < hmm->n_symbols; ++k) {
+      float p = j >= model->n_states ? 0
+                : total > 0 ? emissions[j * hmm->n_symbols + k] / total
+                            : 1.0f / hmm->n_symbols;
+      hmm->log_emissions[k * width + j] = p > 0 ? logf(p) : PM_LOG_ZERO;
+    }
+  }
+  free(emissions);
+
+  build_log_transitions(model, hmm);
+  for (int64_t i = 0; i < model->n_grams; ++i) hmm->delta[i] = 0;
+
+  return hmm;
+}
+
+// Advances the Viterbi recursion by one observation, whose emission log
+// probabilities by state are log_b (or NULL if the symbol is unknown).
+// Returns the most likely gram at the newest frame.
+static int64_t viterbi_step(const pm_model *model, pm_hmm *hmm,
+                            const float *log_b) {
+  const int width = model->row_width;
+  float *restrict acc = hmm->acc;
+  int *restrict arg = hmm->arg;
+  float *restrict next_delta = hmm->next_delta;
+  int64_t *restrict backpointers =
+      hmm->backpointers + (hmm->n_frames % hmm->latency) * model->n_grams;
+  int *restrict entered =
+      hmm->entered + (hmm->n_frames % hmm->latency) * model->n_grams;
+
+  for (int64_t i = 0; i < model->n_grams; ++i) {
+    next_delta[i] = PM_LOG_ZERO;
+    backpointers[i] = -1;
+  }
+
+  for (int64_t g = 0; g < hmm->n_groups; ++g) {
+    const int64_t start = hmm->group_starts[g];
+    const int n = hmm->group_starts[g + 1] - start;
+
+    // Max-plus over the group's rows, vectorized across states
+    for (int j = 0; j < width; ++j) {
+      acc[j] = PM_LOG_ZERO;
+      arg[j] = 0;
+    }
+    for (int k = 0; k < n; ++k) {
+      const int64_t i = hmm->group_grams[start + k];
+      const float d = hmm->delta[i];
+      const float *restrict row = hmm->log_transitions + i * width;
+      for (int j = 0; j < width; ++j) {
+        const float candidate = d + row[j];
+        const int better = candidate > acc[j];
+        acc[j] = better ? candidate : acc[j];
+        arg[j] = better ? k : arg[j];
+      }
+    }
+
+    const int64_t *successors = hmm->group_successors + g * width;
+    for (int j = 0; j < model->n_states; ++j)
+      if (successors[j] != -1) {
+        next_delta[successors[j]] = acc[j] + (log_b != NULL ? log_b[j] : 0);
+        backpointers[successors[j]] = hmm->group_grams[start + arg[j]];
+        entered[successors[j]] = j;
+      }
+  }
+
+  // Sampling stays on a gram when the next one is unlisted
+  for (int64_t g = 0; g < hmm->n_groups; ++g) {
+    const int64_t *successors = hmm->group_successors + g * width;
+    for (int64_t k = hmm->group_starts[g]; k < hmm->group_starts[g + 1]; ++k) {
+      const int64_t i = hmm->group_grams[k];
+      const float *row = hmm->log_transitions + i * width;
+      for (int j = 0; j < model->n_states; ++j) {
+        if (successors[j] != -1) continue;
+        const float candidate =
+            hmm->delta[i] + row[j] + (log_b != NULL ? log_b[j] : 0);
+        if (candidate > next_delta[i]) {
+          next_delta[i] = candidate;
+          backpointers[i] = i;
+          entered[i] = j;
+        }
+      }
+    }
+  }
+
+  // Renormalize so the best path stays at 0
+  int64_t best = 0;
+  for (int64_t i = 1; i < model->n_grams; ++i)
+    if (next_delta[i] > next_delta[best]) best = i;
+  const float max = next_delta[best];
+  for (int64_t i = 0; i < model->n_grams; ++i)
+    next_delta[i] = fmaxf(next_delta[i] - max, PM_LOG_ZERO);
+
+  hmm->next_delta = hmm->delta;
+  hmm->delta = next_delta;
+  ++hmm->n_frames;
+  return best;
+}
+
+// Follows the best path back latency - 1 frames, writing the state sampled
+// into the gram reached, or returns -1 until that many frames were observed
+static int64_t traceback(const pm_model *model, const pm_hmm *hmm,
+                         int64_t gram_i, int *state_i) {
+  if (hmm->n_frames < hmm->latency) return -1;
+
+  for (int k = 0; k < hmm->latency - 1 && gram_i != -1; ++k) {
+    int64_t frame = (hmm->n_frames - 1 - k) % hmm->latency;
+    gram_i = hmm->backpointers[frame * model->n_grams + gram_i];
+  }
+  if (gram_i != -1) {
+    int64_t frame = hmm->n_frames % hmm->latency;  // n_frames - latency
+    *state_i = hmm->entered[frame * model->n_grams + gram_i];
+  }
+  return gram_i;
+}
+
+void pm_hmm_reorder(pm_hmm *hmm, const pm_model *model,
+                    const int64_t *where) {
+  for (int64_t i = 0; i < model->n_grams; ++i) {
+    hmm->group_grams[i] = where[hmm->group_grams[i]];
+    hmm->delta[i] = 0;
+  }
+  for (int64_t i = 0; i < hmm->n_groups * model->row_width; ++i)
+    if (hmm->group_successors[i] != -1)
+      hmm->group_successors[i] = where[hmm->group_successors[i]];
+  hmm->n_frames = 0;
+}
+
+int64_t pm_hmm_observe(const pm_model *model, pm_hmm *hmm, int symbol_i,
+                       int *state_i) {
+  if (hmm->revision != model->revision) build_log_transitions(model, hmm);
+
+  const float *log_b =
+      symbol_i != -1 ? hmm->log_emissions + symbol_i * model->row_width : NULL;
+  return traceback(model, hmm, viterbi_step(model, hmm, log_b), state_i);
+}
+
+// One step taken ahead, tagged with the restart it belongs to
+typedef struct _lookahead {
+  pm_cursor cursor;  // Cursor after the step
+  int state_i;       // Sampled state, or -1
+  uint64_t generation;
+  uint64_t seq;  // Steps taken before it since the restart
+} lookahead;
+
+struct _pm_prefetch {
+  const pm_model *model;
+  const pm_model *target;
+  const pm_smoother *smoother;
+  pm_cursor cursor;         // Worker's cursor, ahead of the reader's
+  uint64_t seen;            // Worker's generation
+  uint64_t seq;             // Steps the worker took since seen
+  uint64_t expected_seq;    // Next step the reader takes, by the reader
+  uint64_t n_missed;        // Steps the reader sampled itself
+  pthread_mutex_t lock;     // Guards restart
+  pm_cursor restart;        // Cursor the worker restarts from at a retune
+  lookahead *ring;
+  uint64_t mask;  // capacity - 1
+  // Each index is written by one side only, on its own cache line
+  _Alignas(64) atomic_uint_fast64_t head;  // Steps pushed by the worker
+  _Alignas(64) atomic_uint_fast64_t tail;  // Steps popped by the reader
+  _Alignas(64) atomic_uint_fast64_t generation;  // Retunes, by the reader
+  _Alignas(64) atomic_int running;
+  pthread_t thread;
+  int started;
+};
+
+static inline int take_step(const pm_prefetch *p, pm_cursor *cursor) {
+  return p->smoother != NULL
+             ? pm_smooth_step(p->model, p->target, p->smoother, cursor)
+             : pm_step(p->model, p->target, cursor);
+}
+
+// Pushes one step if the ring has room. Returns 0 if it is full.
+static int push_step(pm_prefetch *p) {
+  const uint64_t head = atomic_load_explicit(&p->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&p->tail, memory_order_acquire) > p->mask)
+    return 0;
+
+  lookahead *step = &p->ring[head & p->mask];
+  step->state_i = take_step(p, &p->cursor);
+  step->cursor = p->cursor;
+  step->generation = p->seen;
+  step->seq = p->seq++;
+  atomic_store_explicit(&p->head, head + 1, memory_order_release);
+  return 1;
+}
+
+// Adopts the reader's latest restart, if there is a newer one
+static void follow_retune(pm_prefetch *p) {
+  if (atomic_load_explicit(&p->generation, memory_order_relaxed) == p->seen)
+    return;
+
+  pthread_mutex_lock(&p->lock);
+  p->seen = atomic_load_explicit(&p->generation, memory_order_relaxed);
+  p->cursor = p->restart;
+  pthread_mutex_unlock(&p->lock);
+  p->seq = 0;
+}
+
+static void *prefetch_thread(void *arg) {
+  pm_prefetch *p = (pm_prefetch *)arg;
+  const struct timespec idle = {0, PREFETCH_IDLE_NS};
+  while (atomic_load_explicit(&p->running, memory_order_relaxed)) {
+    follow_retune(p);
+    if (!push_step(p)) nanosleep(&idle, NULL);
+  }
+  return NULL;
+}
+
+pm_prefetch *pm_prefetch_new(int capacity) {
+  pm_prefetch *p;
+  if (posix_memalign((void **)&p, 64, sizeof(pm_prefetch))) return NULL;
+  memset(p, 0, sizeof(pm_prefetch));
+
+  if (posix_memalign((void **)&p->ring, 64, capacity * sizeof(lookahead))) {
+    free(p);
+    return NULL;
+  }
+  p->mask = capacity - 1;
+  pthread_mutex_init(&p->lock, NULL);
+  atomic_init(&p->head, 0);
+  atomic_init(&p->tail, 0);
+  atomic_init(&p->generation, 0);
+  atomic_init(&p->running, 0);
+  return p;
+}
+
+void pm_prefetch_free(pm_prefetch *prefetch) {
+  if (prefetch == NULL) return;
+
+  pm_prefetch_stop(prefetch);
+  pthread_mutex_destroy(&prefetch->lock);
+  free(prefetch->ring);
+  free(prefetch);
+}
+
+int pm_prefetch_start(pm_prefetch *prefetch, const pm_model *model,
+                      const pm_model *target, const pm_smoother *smoother,
+                      const pm_cursor *cursor) {
+  pm_prefetch_stop(prefetch);
+  prefetch->model = model;
+  prefetch->target = target;
+  prefetch->smoother = smoother;
+  prefetch->cursor = *cursor;
+  prefetch->seen =
+      atomic_load_explicit(&prefetch->generation, memory_order_relaxed);
+  prefetch->seq = 0;
+  prefetch->expected_seq = 0;
+
+  for (int i = 0; i < PREFETCH_PREFILL && push_step(prefetch); ++i) continue;
+
+  atomic_store_explicit(&prefetch->running, 1, memory_order_relaxed);
+  prefetch->started =
+      pthread_create(&prefetch->thread, NULL, prefetch_thread, prefetch) == 0;
+  if (!prefetch->started) {
+    atomic_store_explicit(&prefetch->running, 0, memory_order_relaxed);
+    return 1;
+  }
+  return 0;
+}
+
+void pm_prefetch_stop(pm_prefetch *prefetch) {
+  if (prefetch->started) {
+    atomic_store_explicit(&prefetch->running, 0, memory_order_relaxed);
+    pthread_join(prefetch->thread, NULL);
+    prefetch->started = 0;
+  }
+  atomic_store_explicit(&prefetch->head, 0, memory_order_relaxed);
+  atomic_store_explicit(&prefetch->tail, 0, memory_order_relaxed);
+}
+
+void pm_prefetch_retune(pm_prefetch *prefetch, const pm_cursor *cursor) {
+  pthread_mutex_lock(&prefetch->lock);
+  prefetch->restart = *cursor;
+  atomic_fetch_add_explicit(&prefetch->generation, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&prefetch->lock);
+  prefetch->expected_seq = 0;
+}
+
+int pm_prefetch_step(pm_prefetch *prefetch, pm_cursor *cursor) {
+  const uint64_t generation =
+      atomic_load_explicit(&prefetch->generation, memory_order_relaxed);
+  const uint64_t head =
+      atomic_load_explicit(&prefetch->head, memory_order_acquire);
+  uint64_t tail = atomic_load_explicit(&prefetch->tail, memory_order_relaxed);
+
+  // Skips steps from before a retune, or already sampled in place
+  int state_i = -2;
+  for (; tail != head && state_i == -2; ++tail) {
+    const lookahead *step = &prefetch->ring[tail & prefetch->mask];
+    if (step->generation == generation &&
+        step->seq == prefetch->expected_seq) {
+      *cursor = step->cursor;
+      state_i = step->state_i;
+    }
+  }
+  atomic_store_explicit(&prefetch->tail, tail, memory_order_release);
+
+  if (state_i == -2) {
+    state_i = take_step(prefetch, cursor);
+    ++prefetch->n_missed;
+  }
+  ++prefetch->expected_seq;
+  return state_i;
+}
+
+uint64_t pm_prefetch_misses(const pm_prefetch *prefetch) {
+  return prefetch->n_missed;
+}
+
+// Runs shared by a pool of threads, each merging into its own partial
+typedef struct _analysis_job {
+  const pm_model *model;
+  const pm_model *target;
+  const pm_smoother *smoother;
+  pm_cursor start;
+  int n_runs;
+  int64_t n_steps;
+  int hitting;  // Whether workers keep hitting tables
+  atomic_int next_run;
+  const atomic_int *stopping;  // Set to give up early, or NULL
+} analysis_job;
+
+typedef struct _analysis_worker {
+  analysis_job *job;
+  pm_analysis *partial;
+  int64_t *open_counts;  // (from, to) samples of from still waiting for to
+  double *open_sums;     // (from, to) step numbers of those samples, summed
+  int *opened;           // States sampled this run, whose rows to clear
+  char *is_open;
+  pthread_t thread;
+} analysis_worker;
+
+static int is_stopping(const analysis_job *job) {
+  return job->stopping != NULL && atomic_load(job->stopping);
+}
+
+static pm_analysis *new_analysis(int n_states, int64_t n_grams, int hitting) {
+  const int64_t n_pairs = (int64_t)n_states * n_states;
+  pm_analysis *a = (pm_analysis *)calloc(1, sizeof(pm_analysis));
+  if (a == NULL) return NULL;
+
+  a->n_states = n_states;
+  a->n_grams = n_grams;
+  a->state_visits = (int64_t *)calloc(n_states, sizeof(int64_t));
+  a->dead_ends = (int64_t *)calloc(n_grams, sizeof(int64_t));
+  if (hitting) {
+    a->hitting_sums = (double *)calloc(n_pairs, sizeof(double));
+    a->hitting_counts = (int64_t *)calloc(n_pairs, sizeof(int64_t));
+  }
+  if (a->state_visits == NULL || a->dead_ends == NULL ||
+      (hitting && (a->hitting_sums == NULL || a->hitting_counts == NULL))) {
+    pm_analysis_free(a);
+    return NULL;
+  }
+  return a;
+}
+
+void pm_analysis_free(pm_analysis *analysis) {
+  if (analysis == NULL) return;
+
+  free(analysis->state_visits);
+  free(analysis->dead_ends);
+  free(analysis->hitting_sums);
+  free(analysis->hitting_counts);
+  free(analysis);
+}
+
+// One run from the start cursor on its own RNG stream, derived from the run
+// number so results do not depend on which thread took it
+static void analyze_run(analysis_worker *w, int run) {
+  const analysis_job *job = w->job;
+  pm_analysis *a = w->partial;
+  const int n = a->n_states;
+  pm_cursor cursor = job->start;
+  pm_rng seeder = {job->start.rng.state ^ hash_key((uint64_t)run + 1)};
+  cursor.rng.state = pm_rng_next(&seeder);
+
+  int n_opened = 0;
+  for (int64_t t = 0; t < job->n_steps; ++t) {
+    if ((t & ANALYSIS_STOP_MASK) == 0 && is_stopping(job)) break;
+    const int64_t gram_i = cursor.gram_i;
+    const int state_i =
+        job->smoother != NULL
+            ? pm_smooth_step(job->model, job->target, job->smoother, &cursor)
+            : pm_step(job->model, job->target, &cursor);
+    if (state_i == -1) {
+      if (gram_i != -1)
+        ++a->dead_ends[gram_i];
+      else
+        ++a->n_lost;
+      break;
+    }
+    ++a->state_visits[state_i];
+    ++a->n_steps;
+    if (!job->hitting) continue;
+
+    // Samples waiting for this state are answered, then it starts waiting
+    // for every state
+    for (int from = 0; from < n_opened; ++from) {
+      const int64_t pair = (int64_t)w->opened[from] * n + state_i;
+      a->hitting_counts[pair] += w->open_counts[pair];
+      a->hitting_sums[pair] += w->open_counts[pair] * (double)t -
+                               w->open_sums[pair];
+      w->open_counts[pair] = 0;
+      w->open_sums[pair] = 0;
+    }
+    if (!w->is_open[state_i]) {
+      w->is_open[state_i] = 1;
+      w->opened[n_opened++] = state_i;
+    }
+    for (int to = 0; to < n; ++to) {
+      ++w->open_counts[(int64_t)state_i * n + to];
+      w->open_sums[(int64_t)state_i * n + to] += t;
+    }
+  }
+
+  // Samples never answered within the run do not count
+  for (int i = 0; i < n_opened; ++i) {
+    const int from = w->opened[i];
+    memset(w->open_counts + (int64_t)from * n, 0, n * sizeof(int64_t));
+    memset(w->open_sums + (int64_t)from * n, 0, n * sizeof(double));
+    w->is_open[from] = 0;
+  }
+}
+
+static void *analysis_thread(void *arg) {
+  analysis_worker *w = (analysis_worker *)arg;
+  for (int run = atomic_fetch_add(&w->job->next_run, 1);
+       run < w->job->n_runs && !is_stopping(w->job);
+       run = atomic_fetch_add(&w->job->next_run, 1))
+    analyze_run(w, run);
+  return NULL;
+}
+
+static void free_worker(analysis_worker *w) {
+  pm_analysis_free(w->partial);
+  free(w->open_counts);
+  free(w->open_sums);
+  free(w->opened);
+  free(w->is_open);
+}
+
+static int init_worker(analysis_worker *w, analysis_job *job) {
+  const int n = job->model->n_states;
+  w->job = job;
+  w->partial = new_analysis(n, job->model->n_grams, job->hitting);
+  if (job->hitting) {
+    w->open_counts = (int64_t *)calloc((int64_t)n * n, sizeof(int64_t));
+    w->open_sums = (double *)calloc((int64_t)n * n, sizeof(double));
+    w->opened = (int *)malloc(n * sizeof(int));
+    w->is_open = (char *)calloc(n, sizeof(char));
+  }
+  return w->partial == NULL ||
+         (job->hitting && (w->open_counts == NULL || w->open_sums == NULL ||
+                           w->opened == NULL || w->is_open == NULL));
+}
+
+// Runs the job on up to n_threads threads, as many as ANALYSIS_MAX_BYTES of
+// hitting tables allow, and merges their partials into the first one
+static pm_analysis *analyze(analysis_job *job, int n_threads) {
+  const int n = job->model->n_states;
+  const int64_t worker_bytes =
+      (int64_t)n * n * (2 * sizeof(int64_t) + 2 * sizeof(double));
+  job->hitting = worker_bytes <= ANALYSIS_MAX_BYTES;
+  if (job->hitting && n_threads > ANALYSIS_MAX_BYTES / worker_bytes)
+    n_threads = ANALYSIS_MAX_BYTES / worker_bytes;
+  if (n_threads < 1) n_threads = 1;
+  analysis_worker *workers =
+      (analysis_worker *)calloc(n_threads, sizeof(analysis_worker));
+  if (workers == NULL) return NULL;
+
+  // Workers that cannot be allocated or started leave their share to the
+  // others, and the calling thread works as the first
+  int n_ready = 0;
+  while (n_ready < n_threads && !init_worker(&workers[n_ready], job))
+    ++n_ready;
+  if (n_ready < n_threads) free_worker(&workers[n_ready]);
+  int n_started = 1;
+  while (n_started < n_ready &&
+         pthread_create(&workers[n_started].thread, NULL, analysis_thread,
+                        &workers[n_started]) == 0)
+    ++n_started;
+  if (n_ready > 0) analysis_thread(&workers[0]);
+  for (int i = 1; i < n_started; ++i) pthread_join(workers[i].thread, NULL);
+
+  pm_analysis *analysis = n_ready > 0 ? workers[0].partial : NULL;
+  for (int i = 1; i < n_started; ++i) {
+    const pm_analysis *p = workers[i].partial;
+    analysis->n_steps += p->n_steps;
+    analysis->n_lost += p->n_lost;
+    for (int j = 0; j < n; ++j) analysis->state_visits[j] += p->state_visits[j];
+    for (int64_t g = 0; g < analysis->n_grams; ++g)
+      analysis->dead_ends[g] += p->dead_ends[g];
+    for (int64_t pair = 0; job->hitting && pair < (int64_t)n * n; ++pair) {
+      analysis->hitting_counts[pair] += p->hitting_counts[pair];
+      analysis->hitting_sums[pair] += p->hitting_sums[pair];
+    }
+  }
+
+  if (n_ready > 0) workers[0].partial = NULL;
+  for (int i = 0; i < n_ready; ++i) free_worker(&workers[i]);
+  free(workers);
+  if (is_stopping(job)) {
+    pm_analysis_free(analysis);
+    return NULL;
+  }
+  return analysis;
+}
+
+pm_analysis *pm_analyze(const pm_model *model, const pm_model *target,
+                        const pm_smoother *smoother, const pm_cursor *start,
+                        int n_runs, int64_t n_steps, int n_threads) {
+  analysis_job job = {model,  target, smoother, *start,
+                      n_runs, n_steps, 0,      0,      NULL};
+  atomic_init(&job.next_run, 0);
+  return analyze(&job, n_threads);
+}
+
+struct _pm_analyzer {
+  analysis_job job;
+  int n_threads;
+  atomic_int stopping;
+  atomic_int done;
+  pm_analysis *analysis;  // Written before done is set
+  pthread_t thread;
+};
+
+static void *analyzer_thread(void *arg) {
+  pm_analyzer *analyzer = (pm_analyzer *)arg;
+  analyzer->analysis = analyze(&analyzer->job, analyzer->n_threads);
+  atomic_store(&analyzer->done, 1);
+  return NULL;
+}
+
+pm_analyzer *pm_analyzer_start(const pm_model *model, const pm_model *target,
+                               const pm_smoother *smoother,
+                               const pm_cursor *start, int n_runs,
+                               int64_t n_steps, int n_threads) {
+  pm_analyzer *analyzer = (pm_analyzer *)calloc(1, sizeof(pm_analyzer));
+  if (analyzer == NULL) return NULL;
+
+  analyzer->job = (analysis_job){
+      model, target, smoother, *start, n_runs, n_steps, 0, 0,
+      &analyzer->stopping};
+  atomic_init(&analyzer->job.next_run, 0);
+  atomic_init(&analyzer->stopping, 0);
+  atomic_init(&analyzer->done, 0);
+  analyzer->n_threads = n_threads;
+  if (pthread_create(&analyzer->thread, NULL, analyzer_thread, analyzer)) {
+    free(analyzer);
+    return NULL;
+  }
+  return analyzer;
+}
+
+int pm_analyzer_poll(pm_analyzer *analyzer, pm_analysis **analysis) {
+  if (!atomic_load(&analyzer->done)) return 0;
+
+  *analysis = analyzer->analysis;
+  analyzer->analysis = NULL;
+  return 1;
+}
+
+void pm_analyzer_free(pm_analyzer *analyzer) {
+  if (analyzer == NULL) return;
+
+  atomic_store(&analyzer->stopping, 1);
+  pthread_join(analyzer->thread, NULL);
+  pm_analysis_free(analyzer->analysis);
+  free(analyzer);
+}
+
+int pm_model_is_absorbing(const pm_model *model, int64_t gram_i) {
+  const int64_t row = model->gram_rows[gram_i];
+  if (!(row_total(model, row) > 0)) return 0;  // A dead end, not a trap
+
+  for (int j = 0; j < model->n_states; ++j) {
+    const int64_t next = model->successors[gram_i * model->row_width + j];
+    if (weight(model, row, j) > 0 && next != -1 && next != gram_i) return 0;
+  }
+  return 1;
+}
+
+// One step of a partial phrase
+typedef struct _phrase_node {
+  float log_probability;  // Of the phrase up to here
+  int32_t parent;         // Node a step earlier
+  int32_t state_i;
+  int64_t gram_i;  // Gram reached, the parent's if the next is unlisted
+} phrase_node;
+
+// Most likely first, ties in a fixed order
+static int by_phrase(const void *a, const void *b) {
+  const phrase_node *x = (const phrase_node *)a;
+  const phrase_node *y = (const phrase_node *)b;
+  if (x->log_probability != y->log_probability)
+    return x->log_probability < y->log_probability ? 1 : -1;
+  if (x->parent != y->parent) return x->parent < y->parent ? -1 : 1;
+  return x->state_i - y->state_i;
+}
+
+static int by_gram(const void *a, const void *b) {
+  const phrase_node *x = (const phrase_node *)a;
+  const phrase_node *y = (const phrase_node *)b;
+  if (x->gram_i != y->gram_i) return x->gram_i < y->gram_i ? -1 : 1;
+  return by_phrase(a, b);
+}
+
+int pm_best(const pm_model *model, int64_t gram_i, int n_steps, int k,
+            int beam, int *states, float *log_probabilities) {
+  if (gram_i == -1 || n_steps < 1 || k < 1) return 0;
+  if (beam < k) beam = k;
+
+  const int width = model->row_width;
+  phrase_node *nodes =
+      (phrase_node *)malloc((size_t)n_steps * beam * sizeof(phrase_node));
+  phrase_node *candidates = (phrase_node *)malloc(
+      (size_t)beam * model->n_states * sizeof(phrase_node));
+  if (nodes == NULL || candidates == NULL) {
+    free(nodes);
+    free(candidates);
+    return -1;
+  }
+
+  const phrase_node root = {0, -1, -1, gram_i};
+  const phrase_node *frontier = &root;
+  int n_frontier = 1;
+  int t = 0;
+  for (; t < n_steps && n_frontier > 0; ++t) {
+    int n = 0;
+    for (int e = 0; e < n_frontier; ++e) {
+      const phrase_node *from = &frontier[e];
+      for (int j = 0; j < model->n_states; ++j) {
+        const float lp = log_probability(model, from->gram_i, j);
+        const int64_t next = model->successors[from->gram_i * width + j];
+        // Sampling stays on the gram when the next one is unlisted
+        if (lp > PM_LOG_ZERO)
+          candidates[n++] = (phrase_node){from->log_probability + lp, e, j,
+                                          next != -1 ? next : from->gram_i};
+      }
+    }
+
+    // Phrases into the same gram share their futures, so only its k most
+    // likely can lead to any of the k best
+    qsort(candidates, n, sizeof(phrase_node), by_gram);
+    int n_kept = 0;
+    for (int c = 0, run = 0; c < n; ++c) {
+      run = c > 0 && candidates[c].gram_i == candidates[c - 1].gram_i
+                ? run + 1
+                : 0;
+      if (run < k) candidates[n_kept++] = candidates[c];
+    }
+    qsort(candidates, n_kept, sizeof(phrase_node), by_phrase);
+
+    n_frontier = n_kept < beam ? n_kept : beam;
+    phrase_node *level = nodes + (size_t)t * beam;
+    memcpy(level, candidates, n_frontier * sizeof(phrase_node));
+    frontier = level;
+  }
+
+  const int n_found = t == n_steps ? (n_frontier < k ? n_frontier : k) : 0;
+  for (int i = 0; i < n_found; ++i) {
+    log_probabilities[i] = frontier[i].log_probability;
+    for (int step = n_steps - 1, node = i; step >= 0; --step) {
+      const phrase_node *at = &nodes[(size_t)step * beam + node];
+      states[(size_t)i * n_steps + step] = at->state_i;
+      node = at->parent;
+    }
+  }
+  free(nodes);
+  free(candidates);
+  return n_found;
+}
+
+struct _pm_watch {
+  char *csv_path;
+  int order;
+  int n_states;
+  pm_memory memory;
+  _Atomic(pm_model *) pending;  // Loaded and not yet taken, or NULL
+
+  pthread_mutex_t lock;  // Guards stopping, so a stop wakes the poll
+  pthread_cond_t wake;
+  int stopping;
+  pthread_t thread;
+};
+
+// Compares modification times to the nanosecond, so a same-size edit within
+// the second of the last look still counts
+static int same_file(const struct stat *a, const struct stat *b) {
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         a->st_size == b->st_size && a->st_mtime == b->st_mtime &&
+         MTIME_NSEC(a) == MTIME_NSEC(b);
+}
+
+static void *watch_thread(void *arg) {
+  pm_watch *w = (pm_watch *)arg;
+  struct stat loaded, now;
+  if (stat(w->csv_path, &loaded)) memset(&loaded, 0, sizeof(loaded));
+  struct stat changed = loaded;  // As seen on the previous poll
+
+  pthread_mutex_lock(&w->lock);
+  while (!w->stopping) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += WATCH_POLL_NS;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_nsec -= 1000000000;
+      ++deadline.tv_sec;
+    }
+    pthread_cond_timedwait(&w->wake, &w->lock, &deadline);
+    if (w->stopping || stat(w->csv_path, &now)) continue;
+
+    if (same_file(&now, &loaded)) {
+      changed = loaded;
+    } else if (!same_file(&now, &changed)) {
+      changed = now;  // Still being written, perhaps
+    } else {
+      pthread_mutex_unlock(&w->lock);
+      pm_model *model = pm_model_load_csv(w->csv_path, w->order, w->n_states,
+                                          &w->memory, NULL, NULL);
+      if (model != NULL) pm_model_free(atomic_exchange(&w->pending, model));
+      pthread_mutex_lock(&w->lock);
+      loaded = now;
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
+
+pm_watch *pm_watch_new(const char *csv_path, int order, int n_states,
+                       const pm_memory *memory) {
+  pm_watch *w = (pm_watch *)calloc(1, sizeof(pm_watch));
+  if (w == NULL) return NULL;
+  if ((w->csv_path = strdup(csv_path)) == NULL) {
+    free(w);
+    return NULL;
+  }
+  w->order = order;
+  w->n_states = n_states;
+  w->memory = *memory;
+  atomic_init(&w->pending, NULL);
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->wake, NULL);
+
+  if (pthread_create(&w->thread, NULL, watch_thread, w) != 0) {
+    pthread_cond_destroy(&w->wake);
+    pthread_mutex_destroy(&w->lock);
+    free(w->csv_path);
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+void pm_watch_free(pm_watch *watch) {
+  if (watch == NULL) return;
+
+  pthread_mutex_lock(&watch->lock);
+  watch->stopping = 1;
+  pthread_cond_signal(&watch->wake);
+  pthread_mutex_unlock(&watch->lock);
+  pthread_join(watch->thread, NULL);
+
+  pm_model_free(atomic_load(&watch->pending));
+  pthread_cond_destroy(&watch->wake);
+  pthread_mutex_destroy(&watch->lock);
+  free(watch->csv_path);
+  free(watch);
+}
+
+pm_model *pm_watch_take(pm_watch *watch) {
+  if (atomic_load_explicit(&watch->pending, memory_order_relaxed) == NULL)
+    return NULL;
+  return atomic_exchange(&watch->pending, NULL);
+}
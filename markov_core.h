@@ -0,0 +1,390 @@
+// Pd-independent core of [markov]: model, loader and sampler.
+//
+// A loaded pm_model is immutable while sampled, so any number of threads can
+// share it, each stepping its own pm_cursor. Functions that edit a model
+// (pm_model_set, pm_model_mute) must not run while it is being sampled.
+//
+// pm_step, pm_smooth_step, pm_score and pm_hmm_observe are real-time safe:
+// they never allocate, lock or make system calls (make rt-test checks the
+// samplers and the scorer). Loading, cloning and pm_model_set may allocate.
+#ifndef MARKOV_CORE_H
+#define MARKOV_CORE_H
+
+#include <stdint.h>
+
+#define PM_LOG_ZERO -1e30f  // Finite log(0), safe under -ffast-math
+
+// Receives warnings and errors from the loaders
+typedef void (*pm_log_fn)(void *user, const char *message);
+
+// Open-addressing map from 64-bit keys to indices
+typedef struct _pm_map {
+  uint64_t *keys;
+  int64_t *values;  // -1 marks an empty slot
+  uint64_t mask;    // capacity - 1, capacity is a power of two
+  int64_t size;
+} pm_map;
+
+int pm_map_init(pm_map *map, uint64_t capacity);
+void pm_map_free(pm_map *map);
+int64_t pm_map_get(const pm_map *map, uint64_t key);
+int pm_map_put(pm_map *map, uint64_t key, int64_t value);
+
+// splitmix64, one 64-bit word of state per cursor
+typedef struct _pm_rng {
+  uint64_t state;
+} pm_rng;
+
+static inline uint64_t pm_rng_next(pm_rng *rng) {
+  uint64_t z = (rng->state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// Placement of the large tables of a model: probability rows, trees,
+// successors, gram tables and scoring tables, and the tables of smoothers and
+// HMMs built on it.
+// Tables under 2 MiB, and systems without a requested feature, fall back to
+// ordinary allocation.
+typedef enum _pm_pages {
+  PM_PAGES_DEFAULT,      // Ordinary allocation
+  PM_PAGES_TRANSPARENT,  // Huge-page aligned and advised (MADV_HUGEPAGE)
+  PM_PAGES_EXPLICIT,     // Reserved huge pages (MAP_HUGETLB), else THP
+} pm_pages;
+
+typedef enum _pm_numa {
+  PM_NUMA_DEFAULT,     // Where the kernel first touches them
+  PM_NUMA_INTERLEAVE,  // Page by page across every node
+  PM_NUMA_BIND,        // On one node
+} pm_numa;
+
+typedef struct _pm_memory {
+  pm_pages pages;
+  pm_numa numa;
+  int node;  // Node for PM_NUMA_BIND, below 64
+} pm_memory;
+
+typedef struct _pm_model pm_model;
+typedef struct _pm_cursor pm_cursor;
+typedef int (*pm_step_fn)(const pm_model *model, const pm_model *target,
+                          pm_cursor *cursor);
+
+struct _pm_model {
+  char *csv_path;
+  int64_t csv_size;      // Of the CSV when loaded, or 0 if not loaded from it
+  int64_t csv_mtime_ns;  // Modification time of the CSV when loaded
+  int is_static;  // Compiled in by markov_gen: never freed, cloned to edit
+
+  pm_memory memory;  // Placement of its tables, kept by clones and edits
+
+  int order;
+  int n_states;
+  int64_t n_grams;  // Grams present in the CSV, at most n_states ** order
+
+  int state_bits;      // Bits per state index in a packed gram key
+  uint64_t gram_mask;  // Bits used by a packed gram key
+
+  char **states;
+  char **grams;         // (index, state)
+  uint64_t *gram_keys;  // (index, packed state indices)
+  int64_t *gram_rows;   // (index) -> row of its transition probabilities
+  pm_map gram_map;      // packed state indices -> index
+  int64_t *name_seeds;  // (bucket) seed, or -1 - slot, hashing gram names
+  int64_t *name_slots;  // (slot) index of the gram whose name hashes there
+
+  // Grams with identical rows share one, copied when an edit tells them apart
+  int64_t n_rows;
+  int64_t row_capacity;   // Rows trees and the scoring tables have room for
+  float **probabilities;  // (row, probability)
+  int64_t *row_refs;      // (row, grams sharing it)
+  float *packed_rows;     // One table holding the first n_packed rows
+  int64_t n_packed;       // Rows split off later get a block each
+
+  // Transition kernel chosen at load time
+  pm_step_fn step;
+  int row_width;        // Power-of-two row length of trees
+  char *muted;          // (state, whether it is masked out of every row)
+  float *trees;         // (row, Fenwick tree over unmuted probabilities)
+  int64_t *gram_table;  // packed state indices -> index, or NULL to hash
+  int64_t *successors;  // (index, state) -> index reached, or -1
+  int64_t revision;     // Bumped by every edit to probabilities or muted
+
+  // Scoring tables, kept in step with edits
+  float *log_weights;  // (row, log probability before normalizing)
+  float *log_totals;   // (row, log of the unmuted row total)
+  int32_t *ranks;      // (row, rank) -> state by probability, or NULL
+};
+
+// Position of one sampler in a model and, if crossfading, a target model
+// over the same states
+struct _pm_cursor {
+  uint64_t key;
+  int64_t gram_i;            // Index of key in the model, or -1
+  int64_t target_gram_i;     // Index of key in the target, or -1
+  uint64_t morph_threshold;  // morph * 2 ** 32, compared to a 32-bit draw
+  pm_rng rng;
+  uint32_t draw;  // Random draw of the last step
+
+  // Reshaping of each drawn row, through the rows' ranks
+  float inv_temperature;
+  int top_k;   // States kept, or 0 for all
+  int shaped;  // Whether either differs from plain sampling
+};
+
+// Reads a stream of states to score it under a model
+typedef struct _pm_scorer {
+  uint64_t key;
+  int64_t gram_i;  // Index of key, or -1
+  int n_read;      // States read, saturating at order
+} pm_scorer;
+
+// Loads and compiles a model placed by memory, or by default if NULL, or
+// returns NULL
+pm_model *pm_model_load_csv(const char *csv_path, int order, int n_states,
+                            const pm_memory *memory, pm_log_fn log,
+                            void *user);
+void pm_model_free(pm_model *model);
+// Whether the CSV a model was loaded from has changed on disk since, or can no
+// longer be read
+int pm_model_csv_changed(const pm_model *model);
+// Picks the kernel of a model whose tables markov_gen compiled into the
+// program, which cannot name it
+void pm_model_link(pm_model *model);
+// Deep copy, for editing a model other cursors are sampling. NULL on failure.
+pm_model *pm_model_clone(const pm_model *model);
+// Deep copy placed by memory, to move a model. NULL on failure.
+pm_model *pm_model_place(const pm_model *model, const pm_memory *memory);
+
+// Packs a gram such as "AD" into its state indices, oldest state highest.
+// Returns 1 if the gram is not exactly `order` known states.
+int pm_model_parse_gram(const pm_model *model, const char *gram,
+                        uint64_t *key);
+int64_t pm_model_find_gram(const pm_model *model, uint64_t key);
+// Index of a gram by its name in the CSV, or -1, through a minimal perfect
+// hash built at load: two string hashes and one comparison
+int64_t pm_model_find_name(const pm_model *model, const char *name);
+int pm_model_find_state(const pm_model *model, const char *state);
+int pm_gram_state(const pm_model *model, int64_t gram_i);  // Newest state
+
+// Edits one transition in O(log n_states), first copying its row if other
+// grams share it. Rows are renormalized when sampled. Returns 1 if the copy
+// cannot be allocated.
+int pm_model_set(pm_model *model, int64_t gram_i, int state_i,
+                 float probability);
+// Masks a state out of every row, or restores it
+void pm_model_mute(pm_model *model, int state_i, int muted);
+
+// Copies the rows of source, loaded again from the same CSV, wherever they
+// differ, rebuilding only their trees and scoring tables, so indices and
+// cursors stay valid. Returns the number of rows replaced, or -1 if source
+// lists other states or grams or a row cannot be copied (model may then be
+// partly updated).
+int64_t pm_model_update(pm_model *model, const pm_model *source);
+
+// Builds the rank tables reshaped sampling reads, kept in step with edits
+// from then on. Returns 1 if they cannot be allocated.
+int pm_model_rank(pm_model *model);
+
+// Orders grams so each sits before the one most often visited after it,
+// starting from the most visited, given a sequence of visited grams (-1 for
+// none). Returns where[old index] = new index, to free, or NULL.
+int64_t *pm_model_visit_order(const pm_model *model, const int64_t *visits,
+                              int64_t n_visits);
+// Renumbers grams and their rows by where. Cursors, smoothers and decoders
+// over the model must be remapped too. Returns 1 if it cannot allocate.
+int pm_model_reorder(pm_model *model, const int64_t *where);
+// Writes the model's grams, in their current order, as a CSV it can load
+int pm_model_write_csv(const pm_model *model, const char *csv_path,
+                       pm_log_fn log, void *user);
+
+float pm_row_total(const pm_model *model, int64_t gram_i);
+// Log probability of moving from a gram by a state, PM_LOG_ZERO if impossible
+float pm_log_probability(const pm_model *model, int64_t gram_i, int state_i);
+
+// Places a cursor on the first gram of model
+void pm_cursor_init(pm_cursor *cursor, const pm_model *model,
+                    const pm_model *target, uint64_t seed);
+// Moves a cursor to the gram of a packed key, listed or not
+void pm_cursor_set_key(pm_cursor *cursor, const pm_model *model,
+                       const pm_model *target, uint64_t key);
+// Moves a cursor off a gram neither model lists, which only smoothing can
+// sample from, to the listed gram sharing its longest suffix
+void pm_cursor_settle(pm_cursor *cursor, const pm_model *model,
+                      const pm_model *target);
+void pm_cursor_set_target(pm_cursor *cursor, const pm_model *target);
+void pm_cursor_set_morph(pm_cursor *cursor, float morph);
+// Draws each row from its top_k most likely states (all if 0), reweighted to
+// p ** (1 / temperature); temperature 0 always takes the most likely. Applies
+// to rows of models with ranks, so probabilities are never rewritten.
+void pm_cursor_set_shape(pm_cursor *cursor, float temperature, int top_k);
+
+// Samples the next state from (1 - morph) * model + morph * target, or model
+// alone if target is NULL, and moves to the gram it ends. Returns the state,
+// or -1 at a dead end.
+static inline int pm_step(const pm_model *model, const pm_model *target,
+                          pm_cursor *cursor) {
+  return model->step(model, target, cursor);
+}
+
+// Interpolated smoothing: each transition mixes the model's row with the rows
+// of its order - 1 ... 0 state suffixes, marginalized from the model's grams.
+// Row h of each order keeps weight N / (N + smooth * T), where N is the number
+// of grams merged into it and T its number of distinct successors, and passes
+// the rest down to the next order.
+typedef struct _pm_smoother {
+  int order;             // Order of the model
+  float smooth;          // Pseudo-count per distinct successor
+  pm_model **marginals;  // (order) rows of the grams' suffixes, for order < k
+  float **lambdas;       // (order, index) weight kept by a row, up to order k
+  int64_t revision;      // model->revision the tables were filled at
+} pm_smoother;
+
+pm_smoother *pm_smoother_new(const pm_model *model, float smooth);
+void pm_smoother_free(pm_smoother *smoother);
+// Refills the tables after an edit to model or smooth, without allocating
+void pm_smoother_update(pm_smoother *smoother, const pm_model *model);
+
+// Like pm_step, drawing the model's share of the crossfade from the
+// interpolated orders. The cursor moves to every sampled state, listed or not.
+int pm_smooth_step(const pm_model *model, const pm_model *target,
+                   const pm_smoother *smoother, pm_cursor *cursor);
+
+// Reads one state, -1 if unknown. Returns the log probability of the
+// transition, or 0 while the scorer is still reading its first gram. A
+// step into an unlisted gram stays on the current one, as sampling does. An
+// unknown state scores PM_LOG_ZERO and restarts the scorer.
+float pm_score(const pm_model *model, pm_scorer *scorer, int state_i);
+
+// Hidden Markov decoding: the model's grams are the hidden states, and each
+// emits an observed symbol according to its newest state
+typedef struct _pm_hmm {
+  int n_symbols;
+  char **symbols;
+  float *log_emissions;  // (symbol, state), padded to row_width
+
+  int64_t revision;        // model->revision log_transitions was built at
+  float *log_transitions;  // (index, log probability), padded to row_width
+
+  // Grams sharing their newest order - 1 states share successors, so each
+  // group's rows are max-plus reduced together before one scatter
+  int64_t n_groups;
+  int64_t *group_starts;      // (group, offset into group_grams)
+  int64_t *group_grams;       // Indices ordered by group
+  int64_t *group_successors;  // (group, state) -> index, or -1 to stay
+  float *acc;                 // (state) best log probability within a group
+  int *arg;                   // (state) offset of acc's best gram in the group
+
+  int latency;  // Frames the decoded state trails the newest observation
+  int64_t n_frames;
+  float *delta;  // (index, log probability of the best path ending there)
+  float *next_delta;
+  int64_t *backpointers;  // (frame % latency, index) -> predecessor index
+  int *entered;           // (frame % latency, index) -> state sampled into it
+} pm_hmm;
+
+// Loads a CSV of emission probabilities with observed symbols as columns and
+// states as rows. Rows are normalized and missing states emit uniformly.
+pm_hmm *pm_hmm_load_csv(const pm_model *model, const char *csv_path,
+                        int latency, pm_log_fn log, void *user);
+void pm_hmm_free(pm_hmm *hmm);
+
+// Decodes one observed symbol, -1 if unknown. Returns the most likely gram
+// latency - 1 observations back, or -1 until that many were observed, and
+// writes the state sampled then: the gram's newest, unless sampling stayed
+// on it because the next gram was unlisted.
+int64_t pm_hmm_observe(const pm_model *model, pm_hmm *hmm, int symbol_i,
+                       int *state_i);
+// Follows pm_model_reorder, restarting decoding
+void pm_hmm_reorder(pm_hmm *hmm, const pm_model *model, const int64_t *where);
+
+// Totals of independent runs of a chain, each from the same cursor on its
+// own RNG stream
+typedef struct _pm_analysis {
+  int n_states;
+  int64_t n_grams;
+  int64_t n_steps;        // Steps taken by every run
+  int64_t n_lost;         // Runs stopped off any listed gram
+  int64_t *state_visits;  // (state) times sampled
+  int64_t *dead_ends;     // (index) runs stopped there, with nothing to sample
+  // (from, to) steps from sampling from until next sampling to, and how many
+  // such waits ended within their run. NULL when each thread would need
+  // more than 1 GiB for them, n_states ** 2 * 32 bytes.
+  double *hitting_sums;
+  int64_t *hitting_counts;
+} pm_analysis;
+
+// Takes n_runs runs of at most n_steps from start, sampled like the cursor
+// (with target and smoother if not NULL), spread over up to n_threads threads
+// including the caller, fewer if their hitting tables would pass 1 GiB.
+// Models must not be edited meanwhile. NULL on failure.
+pm_analysis *pm_analyze(const pm_model *model, const pm_model *target,
+                        const pm_smoother *smoother, const pm_cursor *start,
+                        int n_runs, int64_t n_steps, int n_threads);
+void pm_analysis_free(pm_analysis *analysis);
+
+// pm_analyze on a thread of its own, for callers that cannot block. Models
+// and smoother must outlive it unedited.
+typedef struct _pm_analyzer pm_analyzer;
+
+pm_analyzer *pm_analyzer_start(const pm_model *model, const pm_model *target,
+                               const pm_smoother *smoother,
+                               const pm_cursor *start, int n_runs,
+                               int64_t n_steps, int n_threads);
+// Returns 1 once finished, handing over the analysis, or NULL on failure
+int pm_analyzer_poll(pm_analyzer *analyzer, pm_analysis **analysis);
+// Gives up on the runs left and waits for the threads
+void pm_analyzer_free(pm_analyzer *analyzer);
+// Whether a gram can be sampled but never left
+int pm_model_is_absorbing(const pm_model *model, int64_t gram_i);
+
+// Finds up to k of the most likely phrases of n_steps states from a gram
+// under the model alone, staying on a gram whose next is unlisted as
+// sampling does, by k-best Viterbi over its log probabilities keeping at
+// most beam partial phrases per step: exact while no step has more. Writes
+// states (phrase, step) and each phrase's log probability, most likely
+// first. Returns how many it found, or -1 if it cannot allocate.
+int pm_best(const pm_model *model, int64_t gram_i, int n_steps, int k,
+            int beam, int *states, float *log_probabilities);
+
+// Worker thread stepping a private cursor ahead of the reader into a
+// single-producer, single-consumer ring. The reader never waits: a step is
+// two atomic loads and a copy, or sampled in place if the worker is behind.
+typedef struct _pm_prefetch pm_prefetch;
+
+pm_prefetch *pm_prefetch_new(int capacity);  // capacity is a power of two
+void pm_prefetch_free(pm_prefetch *prefetch);
+// Fills part of the ring from cursor on the calling thread, then starts the
+// worker. Models must not be edited until pm_prefetch_stop. Returns 1 if the
+// thread cannot be started.
+int pm_prefetch_start(pm_prefetch *prefetch, const pm_model *model,
+                      const pm_model *target, const pm_smoother *smoother,
+                      const pm_cursor *cursor);
+// Joins the worker and drops the steps not yet taken
+void pm_prefetch_stop(pm_prefetch *prefetch);
+// Restarts the running worker from cursor, after a change to the cursor
+// alone (position, RNG, morph or shape), and drops the steps taken ahead.
+// Takes a lock the worker only holds while copying cursor.
+void pm_prefetch_retune(pm_prefetch *prefetch, const pm_cursor *cursor);
+// Moves cursor, the reader's, by the next step and returns its state like
+// pm_step. If the worker has fallen behind, samples the step in place: steps
+// are deterministic given the cursor, so the chain is the same either way.
+int pm_prefetch_step(pm_prefetch *prefetch, pm_cursor *cursor);
+// Steps sampled in place since pm_prefetch_new
+uint64_t pm_prefetch_misses(const pm_prefetch *prefetch);
+
+// Thread polling a model's CSV, which loads it again once a change has
+// settled for one poll. Polls stat rather than waiting on inotify, so it runs
+// wherever the loader does.
+typedef struct _pm_watch pm_watch;
+
+// Starts watching for changes made from now on, loading them placed by
+// memory. NULL on failure.
+pm_watch *pm_watch_new(const char *csv_path, int order, int n_states,
+                       const pm_memory *memory);
+void pm_watch_free(pm_watch *watch);
+// Takes the newest model loaded since the last call, to free, or NULL.
+// Never waits.
+pm_model *pm_watch_take(pm_watch *watch);
+
+#endif
@@ -0,0 +1,187 @@
+// Compiles a model CSV into a C header of static const tables, so an external
+// built with it (make static) starts without reading or parsing a file.
+//
+// Usage: markov_gen <csv> <order> <states> <header>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "markov_core.h"
+
+#define PREFIX "markov_model_"
+
+static void log_stderr(void *user, const char *message) {
+  (void)user;
+  fprintf(stderr, "%s\n", message);
+}
+
+// Starts each of n per line on its own line
+static const char *separator(int64_t i, int n) {
+  return i == 0 ? "\n    " : i % n ? ", " : ",\n    ";
+}
+
+// Hex floats round-trip every table bit for bit
+static void write_floats(FILE *file, const char *name, const float *values,
+                         int64_t n) {
+  fprintf(file, "_Alignas(64) static const float " PREFIX "%s[%" PRId64 "] = {",
+          name, n);
+  for (int64_t i = 0; i < n; ++i)
+    fprintf(file, "%s%af", separator(i, 4), (double)values[i]);
+  fprintf(file, "\n};\n\n");
+}
+
+static void write_indices(FILE *file, const char *name, const int64_t *values,
+                          int64_t n) {
+  fprintf(file, "static const int64_t " PREFIX "%s[%" PRId64 "] = {", name, n);
+  for (int64_t i = 0; i < n; ++i)
+    fprintf(file, "%s%" PRId64, separator(i, 8), values[i]);
+  fprintf(file, "\n};\n\n");
+}
+
+static void write_keys(FILE *file, const char *name, const uint64_t *values,
+                       int64_t n) {
+  fprintf(file, "static const uint64_t " PREFIX "%s[%" PRId64 "] = {", name,
+          n);
+  for (int64_t i = 0; i < n; ++i)
+    fprintf(file, "%s0x%" PRIx64 "u", separator(i, 4), values[i]);
+  fprintf(file, "\n};\n\n");
+}
+
+static void write_string(FILE *file, const char *string) {
+  fputc('"', file);
+  for (; *string != '\0'; ++string) {
+    if (*string == '"' || *string == '\\') fputc('\\', file);
+    fputc(*string, file);
+  }
+  fputc('"', file);
+}
+
+static void write_strings(FILE *file, const char *name, char *const *values,
+                          int64_t n) {
+  fprintf(file, "static char *const " PREFIX "%s[%" PRId64 "] = {", name, n);
+  for (int64_t i = 0; i < n; ++i) {
+    fputs(separator(i, 8), file);
+    write_string(file, values[i]);
+  }
+  fprintf(file, "\n};\n\n");
+}
+
+// Returns 1 if the packed rows cannot be gathered
+static int write_model(FILE *file, const pm_model *model) {
+  float *rows =
+      (float *)malloc(model->n_rows * model->n_states * sizeof(float));
+  if (rows == NULL) return 1;
+
+  const int width = model->row_width;
+  const uint64_t capacity = model->gram_map.mask + 1;
+
+  fprintf(file,
+          "// Generated by markov_gen from %s. Do not edit.\n"
+          "#include \"markov_core.h\"\n\n",
+          model->csv_path);
+  write_strings(file, "states", model->states, model->n_states);
+  write_strings(file, "grams", model->grams, model->n_grams);
+  write_keys(file, "gram_keys", model->gram_keys, model->n_grams);
+  write_indices(file, "gram_rows", model->gram_rows, model->n_grams);
+  write_keys(file, "map_keys", model->gram_map.keys, capacity);
+  write_indices(file, "map_values", model->gram_map.values, capacity);
+  write_indices(file, "name_seeds", model->name_seeds, model->n_grams);
+  write_indices(file, "name_slots", model->name_slots, model->n_grams);
+
+  // Rows in row order, so they stay packed
+  for (int64_t row = 0; row < model->n_rows; ++row)
+    memcpy(rows + row * model->n_states, model->probabilities[row],
+           model->n_states * sizeof(float));
+  write_floats(file, "packed_rows", rows, model->n_rows * model->n_states);
+  free(rows);
+  fprintf(file, "static float *const " PREFIX "probabilities[%" PRId64 "] = {",
+          model->n_grams);
+  for (int64_t row = 0; row < model->n_rows; ++row)
+    fprintf(file, "%s(float *)" PREFIX "packed_rows + %" PRId64,
+            separator(row, 4), row * model->n_states);
+  fprintf(file, "\n};\n\n");
+  write_indices(file, "row_refs", model->row_refs, model->n_rows);
+
+  fprintf(file, "static const char " PREFIX "muted[%d] = {0};\n\n",
+          model->n_states);
+  write_floats(file, "trees", model->trees, model->n_rows * width);
+  if (model->gram_table != NULL)
+    write_indices(file, "gram_table", model->gram_table,
+                  model->gram_mask + 1);
+  write_indices(file, "successors", model->successors, model->n_grams * width);
+  write_floats(file, "log_weights", model->log_weights, model->n_rows * width);
+  write_floats(file, "log_totals", model->log_totals, model->n_rows);
+
+  fprintf(file,
+          "// Read-only: pm_model_link picks its kernel, and edits clone it\n"
+          "static pm_model markov_model = {\n"
+          "    .csv_path = ");
+  write_string(file, model->csv_path);
+  fprintf(file,
+          ",\n"
+          "    .is_static = 1,\n"
+          "    .order = %d,\n"
+          "    .n_states = %d,\n"
+          "    .n_grams = %" PRId64 ",\n"
+          "    .state_bits = %d,\n"
+          "    .gram_mask = 0x%" PRIx64 "u,\n"
+          "    .states = (char **)" PREFIX "states,\n"
+          "    .grams = (char **)" PREFIX "grams,\n"
+          "    .gram_keys = (uint64_t *)" PREFIX "gram_keys,\n"
+          "    .gram_rows = (int64_t *)" PREFIX "gram_rows,\n"
+          "    .gram_map = {(uint64_t *)" PREFIX "map_keys,\n"
+          "                 (int64_t *)" PREFIX "map_values, 0x%" PRIx64
+          "u, %" PRId64 "},\n"
+          "    .name_seeds = (int64_t *)" PREFIX "name_seeds,\n"
+          "    .name_slots = (int64_t *)" PREFIX "name_slots,\n"
+          "    .n_rows = %" PRId64 ",\n"
+          "    .row_capacity = %" PRId64 ",\n"
+          "    .probabilities = (float **)" PREFIX "probabilities,\n"
+          "    .row_refs = (int64_t *)" PREFIX "row_refs,\n"
+          "    .packed_rows = (float *)" PREFIX "packed_rows,\n"
+          "    .n_packed = %" PRId64 ",\n"
+          "    .row_width = %d,\n"
+          "    .muted = (char *)" PREFIX "muted,\n"
+          "    .trees = (float *)" PREFIX "trees,\n"
+          "    .gram_table = %s,\n"
+          "    .successors = (int64_t *)" PREFIX "successors,\n"
+          "    .log_weights = (float *)" PREFIX "log_weights,\n"
+          "    .log_totals = (float *)" PREFIX "log_totals,\n"
+          "};\n",
+          model->order, model->n_states, model->n_grams,
+          model->state_bits, model->gram_mask, model->gram_map.mask,
+          model->gram_map.size, model->n_rows, model->n_rows, model->n_rows,
+          width,
+          model->gram_table != NULL ? "(int64_t *)" PREFIX "gram_table"
+                                    : "NULL");
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 5) {
+    fprintf(stderr, "Usage: %s <csv> <order> <states> <header>\n", argv[0]);
+    return 1;
+  }
+
+  pm_model *model = pm_model_load_csv(argv[1], atoi(argv[2]), atoi(argv[3]),
+                                      NULL, log_stderr, NULL);
+  if (model == NULL) return 1;
+
+  FILE *file = fopen(argv[4], "w");
+  if (file == NULL) {
+    perror(argv[4]);
+    pm_model_free(model);
+    return 1;
+  }
+  int failed = write_model(file, model);
+  pm_model_free(model);
+
+  failed = ferror(file) || failed;
+  if (fclose(file) != 0 || failed) {
+    perror(argv[4]);
+    remove(argv[4]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,219 @@
+// Fails if sampling allocates or locks. Defines malloc, calloc, realloc,
+// posix_memalign, free and pthread_mutex_lock over the C library's, so calls
+// from inside it (strdup, qsort, fopen, ...) are counted too, but only on the
+// thread stepping a model and only while a run is armed.
+//
+// Usage: markov_rt_test <csv> <order> <states>
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "markov_core.h"
+
+#define N_STEPS 1000000
+#define PREFETCH_CAPACITY 1024
+#define PREFETCH_BATCH 1000      // Steps read from a full ring at a time
+#define PREFETCH_FILL_NS 1000000  // Wait for the worker between batches
+
+static _Thread_local int armed;
+static long n_calls;
+
+static void *(*real_malloc)(size_t size);
+static void *(*real_calloc)(size_t n, size_t size);
+static void *(*real_realloc)(void *p, size_t size);
+static int (*real_posix_memalign)(void **p, size_t alignment, size_t size);
+static void (*real_free)(void *p);
+static int (*real_pthread_mutex_lock)(pthread_mutex_t *mutex);
+
+// dlsym may allocate before the real allocator is known: that comes from here
+// and is never freed
+static _Alignas(16) char bootstrap[4096];
+static size_t bootstrap_used;
+
+static int in_bootstrap(const void *p) {
+  return (const char *)p >= bootstrap &&
+         (const char *)p < bootstrap + sizeof(bootstrap);
+}
+
+static void *bootstrap_alloc(size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  if (size > sizeof(bootstrap) - bootstrap_used) return NULL;
+  void *p = bootstrap + bootstrap_used;
+  bootstrap_used += size;
+  return p;
+}
+
+// Returns 1 while the real functions are still being looked up
+static int resolve(void) {
+  static int resolving;
+  if (real_free != NULL) return 0;
+  if (resolving) return 1;
+
+  resolving = 1;
+  real_malloc = (void *(*)(size_t))dlsym(RTLD_NEXT, "malloc");
+  real_calloc = (void *(*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+  real_realloc = (void *(*)(void *, size_t))dlsym(RTLD_NEXT, "realloc");
+  real_posix_memalign = (int (*)(void **, size_t, size_t))dlsym(
+      RTLD_NEXT, "posix_memalign");
+  real_pthread_mutex_lock = (int (*)(pthread_mutex_t *))dlsym(
+      RTLD_NEXT, "pthread_mutex_lock");
+  real_free = (void (*)(void *))dlsym(RTLD_NEXT, "free");
+  resolving = 0;
+  if (real_free == NULL) abort();
+  return 0;
+}
+
+void *malloc(size_t size) {
+  if (resolve()) return bootstrap_alloc(size);
+  n_calls += armed;
+  return real_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  if (resolve()) return bootstrap_alloc(n * size);  // Zeroed, being static
+  n_calls += armed;
+  return real_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  if (resolve()) return NULL;
+  n_calls += armed;
+  if (!in_bootstrap(p)) return real_realloc(p, size);
+
+  void *moved = real_malloc(size);
+  const size_t left = bootstrap + sizeof(bootstrap) - (char *)p;
+  if (moved != NULL) memcpy(moved, p, size < left ? size : left);
+  return moved;
+}
+
+int posix_memalign(void **p, size_t alignment, size_t size) {
+  if (resolve()) return ENOMEM;
+  n_calls += armed;
+  return real_posix_memalign(p, alignment, size);
+}
+
+void free(void *p) {
+  n_calls += armed;
+  if (in_bootstrap(p) || resolve()) return;
+  real_free(p);
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
+  if (resolve()) return 0;
+  n_calls += armed;
+  return real_pthread_mutex_lock(mutex);
+}
+
+static void log_stderr(void *user, const char *message) {
+  (void)user;
+  fprintf(stderr, "%s\n", message);
+}
+
+// Steps N_STEPS times, through prefetch if not NULL, scoring each sampled
+// state. Prefetch is read in batches, each once the worker has had time to
+// fill the ring, so the steps come from it. Without prefetch, dead ends go
+// back to the first gram. Returns 1 if anything was allocated or locked.
+static int run(const char *name, const pm_model *model, const pm_model *target,
+               const pm_smoother *smoother, pm_prefetch *prefetch,
+               pm_cursor *cursor) {
+  pm_scorer scorer = {0, -1, 0};
+  long n_sampled = 0, n_scored = 0;
+
+  n_calls = 0;
+  armed = 1;
+  for (long i = 0; i < N_STEPS; ++i) {
+    if (prefetch != NULL && i % PREFETCH_BATCH == 0) {
+      const struct timespec fill = {0, PREFETCH_FILL_NS};
+      armed = 0;
+      nanosleep(&fill, NULL);
+      armed = 1;
+    }
+    int state_i = prefetch != NULL ? pm_prefetch_step(prefetch, cursor)
+                  : smoother != NULL
+                      ? pm_smooth_step(model, target, smoother, cursor)
+                      : pm_step(model, target, cursor);
+    if (state_i == -1 && prefetch != NULL) continue;
+    if (state_i == -1) {
+      pm_cursor_set_key(cursor, model, target, model->gram_keys[0]);
+      continue;
+    }
+    n_scored += pm_score(model, &scorer, state_i) > PM_LOG_ZERO;
+    ++n_sampled;
+  }
+  armed = 0;
+
+  printf("%-14s %ld sampled, %ld scored, %ld calls\n", name, n_sampled,
+         n_scored, n_calls);
+  return n_calls != 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s <csv> <order> <states>\n", argv[0]);
+    return 1;
+  }
+
+  const int order = atoi(argv[2]);
+  const int n_states = atoi(argv[3]);
+  pm_model *model =
+      pm_model_load_csv(argv[1], order, n_states, NULL, log_stderr, NULL);
+  pm_model *target =
+      pm_model_load_csv(argv[1], order, n_states, NULL, log_stderr, NULL);
+  pm_smoother *smoother =
+      model != NULL ? pm_smoother_new(model, 1) : NULL;
+  if (model == NULL || target == NULL || smoother == NULL) {
+    fprintf(stderr, "Error loading %s\n", argv[1]);
+    return 1;
+  }
+
+  pm_cursor cursor;
+  pm_cursor_init(&cursor, model, NULL, 1);
+  int failed = run("step", model, NULL, NULL, NULL, &cursor);
+  failed = run("smooth step", model, NULL, smoother, NULL, &cursor) || failed;
+
+  pm_cursor_init(&cursor, model, target, 2);
+  pm_cursor_set_morph(&cursor, 0.5f);
+  failed = run("morph", model, target, NULL, NULL, &cursor) || failed;
+
+  int unranked = pm_model_rank(model) || pm_model_rank(target);
+  for (int m = 0; m < smoother->order; ++m)
+    unranked = pm_model_rank(smoother->marginals[m]) || unranked;
+  if (unranked) {
+    fprintf(stderr, "Error allocating memory for ranks\n");
+    return 1;
+  }
+  pm_cursor_set_shape(&cursor, 0.7f, 2);
+  failed = run("shaped", model, target, NULL, NULL, &cursor) || failed;
+  failed =
+      run("shaped smooth", model, target, smoother, NULL, &cursor) || failed;
+
+  // The reader's side, with the worker running or fallen behind
+  pm_prefetch *prefetch = pm_prefetch_new(PREFETCH_CAPACITY);
+  if (prefetch == NULL ||
+      pm_prefetch_start(prefetch, model, target, smoother, &cursor)) {
+    fprintf(stderr, "Error starting the prefetch thread\n");
+    return 1;
+  }
+  failed = run("prefetch", model, target, smoother, prefetch, &cursor) ||
+           failed;
+  const uint64_t n_misses = pm_prefetch_misses(prefetch);
+  printf("prefetch       %llu sampled in place\n",
+         (unsigned long long)n_misses);
+  if (n_misses > N_STEPS / 2) {
+    fprintf(stderr, "Error: the prefetch ring was barely read\n");
+    failed = 1;
+  }
+  pm_prefetch_free(prefetch);
+
+  pm_smoother_free(smoother);
+  pm_model_free(target);
+  pm_model_free(model);
+  puts(failed ? "FAILED: the sampler allocated or locked" : "OK");
+  return failed;
+}